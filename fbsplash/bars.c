@@ -0,0 +1,413 @@
+/*
+ * bars.c - Progress bars drawn from pre-rendered strips
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+/* Every pair of 'inter' boxes is a progress bar. Where it is safe to do so,
+ * the bar is rendered at 0% and at 100% once, when the theme is loaded, and
+ * a progress update then only copies the columns that changed from one of
+ * these strips to the silent image. Bars that overlap (eg. one that grows
+ * over another one that shrinks) are kept in a stack, so that they are still
+ * drawn in the order they appear in the theme. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "splash.h"
+
+static list stacks;
+static int slow_bars;	/* bars that are still rendered the usual way */
+
+/* Copies a w x h block between two buffers with the given line lengths. */
+static void blit(u8 *dst, int dst_len, u8 *src, int src_len, int w, int h)
+{
+	for (; h > 0; h--) {
+		memcpy(dst, src, w * bytespp);
+		dst += dst_len;
+		src += src_len;
+	}
+}
+
+/* Saves the area r of the silent image into a newly allocated strip. */
+static u8 *save_strip(u8 *target, rect *r)
+{
+	int w = r->x2 - r->x1 + 1, h = r->y2 - r->y1 + 1;
+	u8 *strip = malloc(w * h * bytespp);
+
+	if (strip)
+		blit(strip, w * bytespp,
+		     target + (r->y1 * fb_var.xres + r->x1) * bytespp,
+		     fb_var.xres * bytespp, w, h);
+	return strip;
+}
+
+/* Copies the part c of a strip holding the area r to the silent image. */
+static void put_strip(u8 *target, u8 *strip, rect *r, rect *c)
+{
+	int w = r->x2 - r->x1 + 1;
+
+	blit(target + (c->y1 * fb_var.xres + c->x1) * bytespp, fb_var.xres * bytespp,
+	     strip + ((c->y1 - r->y1) * w + c->x1 - r->x1) * bytespp, w * bytespp,
+	     c->x2 - c->x1 + 1, c->y2 - c->y1 + 1);
+}
+
+/* Objects that are never drawn by progress updates and never change. */
+static int obj_fixed(dl_item *d)
+{
+	if (d->type == o_box)
+		return !d->n && (((box*)d->p)->attr & BOX_NOOVER);
+	return d->flags & F_OBJ_STATIC;
+}
+
+/* Objects that are drawn again on every progress update. */
+static int obj_redrawn(dl_item *d)
+{
+	if (d->type == o_box)
+		return !(((box*)d->p)->attr & BOX_NOOVER);
+	if (d->type == o_text)
+		return ((text*)d->p)->flags & F_TXT_EVAL;
+	return 0;
+}
+
+/* Walks the silent display list, calling fn for every object that is not
+ * part of s and might draw over it. seen is the number of bars of the stack
+ * rendered before the object. Stops when fn returns non-zero. */
+static int stack_walk(bar_stack *s, int (*fn)(bar_stack *s, dl_item *d, int seen, u8 *target),
+		      u8 *target)
+{
+	dl_item *d, *end = dl_silent.items + dl_silent.cnt;
+	int seen = 0;
+
+	for (d = dl_silent.items; d < end; d++) {
+		if (d->type == o_box && ((box*)d->p)->stack == s)
+			seen++;
+		else if (rect_overlap(&d->r, &s->r) && fn(s, d, seen, target))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Anything drawn before the bars must be there for good, as the strips are
+ * copied over it. Anything drawn after them must be drawn again on every
+ * update, as whatever it leaves behind over the bars is wiped. */
+static int check_obj(bar_stack *s, dl_item *d, int seen, u8 *target)
+{
+	if (seen == 0)
+		return !obj_fixed(d);
+	if (seen == s->cnt)
+		return !obj_redrawn(d);
+	return 1;
+}
+
+static int draw_obj(bar_stack *s, dl_item *d, int seen, u8 *target)
+{
+	if (seen)
+		return 1;
+
+	render_fixed_obj(d, target);
+	return 0;
+}
+
+static int stack_ok(bar_stack *s)
+{
+	rect r;
+	int k;
+
+	for (k = 0; k < s->cnt; k++) {
+		color *c = &s->bars[k].a->c_ul;
+		if (s->cnt > 1 && (c[0].a != 255 || c[1].a != 255 ||
+				   c[2].a != 255 || c[3].a != 255))
+			return 0;
+	}
+
+	if (stack_walk(s, check_obj, NULL))
+		return 0;
+
+	/* The boot message is drawn last, and only when the whole image is. */
+	if (global_font) {
+		r.x1 = cf.text_x; r.x2 = fb_var.xres - 1;
+		r.y1 = cf.text_y; r.y2 = cf.text_y + global_font->height - 1;
+		if (rect_overlap(&r, &s->r))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Renders the strips for a stack. Expects target to hold the background. */
+static int stack_prep(bar_stack *s, u8 *target)
+{
+	box tmp;
+	int k;
+
+	stack_walk(s, draw_obj, target);
+
+	s->empty = save_strip(target, &s->r);
+	if (!s->empty)
+		return 1;
+
+	for (k = 0; k < s->cnt; k++) {
+		bar *br = &s->bars[k];
+
+		/* The colours and the height of the bar don't change, so this
+		 * is what every column looks like once it's covered. */
+		tmp = *br->a;
+		tmp.x1 = br->r.x1;
+		tmp.x2 = br->r.x2;
+		render_box2(&tmp, target);
+
+		br->full = save_strip(target, &br->r);
+		if (!br->full)
+			return 1;
+		put_strip(target, s->empty, &s->r, &br->r);
+	}
+
+	return 0;
+}
+
+static void stack_free(bar_stack *s)
+{
+	int k;
+
+	for (k = 0; k < s->cnt; k++) {
+		s->bars[k].a->stack = NULL;
+		free(s->bars[k].full);
+	}
+	free(s->empty);
+	free(s);
+}
+
+/* Bars qualify when only their horizontal extent changes with the progress. */
+static int bar_ok(box *a, box *b)
+{
+	return !(a->attr & BOX_NOOVER) &&
+	       a->y1 == b->y1 && a->y2 == b->y2 &&
+	       !memcmp(&a->c_ul, &b->c_ul, 4 * sizeof(color)) &&
+	       !memcmp(&a->c_ul, &a->c_ur, sizeof(color)) &&
+	       !memcmp(&a->c_ll, &a->c_lr, sizeof(color));
+}
+
+static void add_bar(box *a, box *b)
+{
+	bar_stack *s = NULL, *t;
+	bar *br;
+	rect r;
+	item *i;
+
+	r.x1 = min(a->x1, b->x1); r.x2 = max(a->x2, b->x2);
+	r.y1 = a->y1; r.y2 = a->y2;
+
+	for (i = stacks.head; i != NULL; i = i->next) {
+		t = (bar_stack*)i->p;
+		if (!rect_overlap(&t->r, &r))
+			continue;
+		if (s) {
+			/* Would have to merge stacks - not worth it. */
+			slow_bars += s->cnt + t->cnt + 1;
+			s->cnt = t->cnt = 0;
+			return;
+		}
+		s = t;
+	}
+
+	if (!s) {
+		s = calloc(1, sizeof(bar_stack));
+		if (!s) {
+			slow_bars++;
+			return;
+		}
+		s->r = r;
+		list_add(&stacks, s);
+	} else if (!s->cnt || s->cnt == MAX_BAR_STACK) {
+		slow_bars += s->cnt + 1;
+		s->cnt = 0;
+		return;
+	} else {
+		s->r.x1 = min(s->r.x1, r.x1); s->r.x2 = max(s->r.x2, r.x2);
+		s->r.y1 = min(s->r.y1, r.y1); s->r.y2 = max(s->r.y2, r.y2);
+	}
+
+	br = &s->bars[s->cnt++];
+	br->a = a;
+	br->b = b;
+	br->r = r;
+	br->full = NULL;
+}
+
+/* Finds the bars of the theme and renders their strips. target and bgnd
+ * both hold the silent background; target is restored after each stack. */
+void prep_bars(u8 *target, u8 *bgnd)
+{
+	dl_item *d, *end = dl_silent.items + dl_silent.cnt;
+	item *i, *next;
+	bar_stack *s;
+	int k;
+
+	free_bars();
+
+	for (d = dl_silent.items; d < end; d++) {
+		if (d->type != o_box || !d->n)
+			continue;
+
+		if (bar_ok((box*)d->p, d->n))
+			add_bar((box*)d->p, d->n);
+		else
+			slow_bars++;
+	}
+
+	for (i = stacks.head, stacks.head = stacks.tail = NULL; i != NULL; i = next) {
+		next = i->next;
+		s = (bar_stack*)i->p;
+		free(i);
+
+		if (!s->cnt) {
+			free(s);
+			continue;
+		}
+
+		for (k = 0; k < s->cnt; k++)
+			s->bars[k].a->stack = s;
+
+		if (!stack_ok(s) || stack_prep(s, target)) {
+			slow_bars += s->cnt;
+			stack_free(s);
+			restore_damage(target, bgnd);
+			continue;
+		}
+		restore_damage(target, bgnd);
+		list_add(&stacks, s);
+	}
+}
+
+void free_bars()
+{
+	item *i, *next;
+
+	for (i = stacks.head; i != NULL; i = next) {
+		next = i->next;
+		stack_free((bar_stack*)i->p);
+		free(i);
+	}
+
+	list_init(stacks);
+	slow_bars = 0;
+}
+
+/* Swaps the bars with those kept for another screen. */
+void swap_bars(bar_set *s)
+{
+	bar_set t = { stacks, slow_bars };
+
+	stacks = s->stacks;
+	slow_bars = s->slow;
+	*s = t;
+}
+
+/* Whether all bars can be taken back when the progress goes down. */
+int bars_can_shrink()
+{
+	return slow_bars == 0;
+}
+
+static void stack_paint(bar_stack *s, u8 *target, rect *c)
+{
+	rect d;
+	int k;
+
+	put_strip(target, s->empty, &s->r, c);
+
+	for (k = 0; k < s->cnt; k++) {
+		bar *br = &s->bars[k];
+
+		d.x1 = max(c->x1, br->x1); d.x2 = min(c->x2, br->x2);
+		d.y1 = max(c->y1, br->r.y1); d.y2 = min(c->y2, br->r.y2);
+		if (d.x1 <= d.x2 && d.y1 <= d.y2)
+			put_strip(target, br->full, &br->r, &d);
+	}
+
+	add_damage(DMG_FB | DMG_OBJ, c->x1, c->y1, c->x2, c->y2);
+}
+
+/* Adds the columns covered by only one of [x1, x2] and [nx1, nx2]. */
+static void add_columns(damage *d, rect *r, int x1, int x2, int nx1, int nx2)
+{
+	if (x1 > x2 || nx1 > nx2) {
+		damage_add(d, x1, r->y1, x2, r->y2);
+		damage_add(d, nx1, r->y1, nx2, r->y2);
+		return;
+	}
+
+	damage_add(d, min(x1, nx1), r->y1, max(x1, nx1) - 1, r->y2);
+	damage_add(d, min(x2, nx2) + 1, r->y1, max(x2, nx2), r->y2);
+}
+
+/* Brings the bars of a stack up to date with arg_progress, and works out
+ * what has to be painted for that. Unless the whole image is being
+ * rendered, that is only the columns that changed since the last call and
+ * whatever was drawn over the bars in the meantime. */
+void update_bar_stack(bar_stack *s, int progress_only)
+{
+	damage *d = &s->todo;
+	box tmp;
+	int k;
+
+	if (!progress_only || !s->valid) {
+		d->cnt = 1;
+		d->r[0] = s->r;
+	} else {
+		*d = s->dirty;
+	}
+
+	for (k = 0; k < s->cnt; k++) {
+		bar *br = &s->bars[k];
+
+		tmp = *br->a;
+		interpolate_box(&tmp, br->b);
+
+		if (progress_only && s->valid &&
+		    (tmp.x1 != br->x1 || tmp.x2 != br->x2))
+			add_columns(d, &br->r, br->x1, br->x2, tmp.x1, tmp.x2);
+
+		br->x1 = tmp.x1;
+		br->x2 = tmp.x2;
+	}
+
+	s->valid = 1;
+	damage_clear(&s->dirty);
+}
+
+/* Paints what update_bar_stack() found, as far as it lies in the band. */
+void render_bar_stack(bar_stack *s, u8 *target)
+{
+	rect c;
+	int k;
+
+	for (k = 0; k < s->todo.cnt; k++) {
+		c = s->todo.r[k];
+		if (band_clip(&c.y1, &c.y2))
+			stack_paint(s, target, &c);
+	}
+}
+
+/* Called for every area drawn to, so we know what to clean up over the bars
+ * on the next update. */
+void bars_damage(int x1, int y1, int x2, int y2)
+{
+	bar_stack *s;
+	item *i;
+
+	for (i = stacks.head; i != NULL; i = i->next) {
+		s = (bar_stack*)i->p;
+
+		if (!s->valid || x1 > s->r.x2 || x2 < s->r.x1 ||
+		    y1 > s->r.y2 || y2 < s->r.y1)
+			continue;
+
+		damage_add(&s->dirty, max(x1, s->r.x1), max(y1, s->r.y1),
+			   min(x2, s->r.x2), min(y2, s->r.y2));
+	}
+}
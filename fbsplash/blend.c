@@ -0,0 +1,707 @@
+/*
+ * blend.c - Span compositing kernels
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+/* All compositing into the 32bpp images goes through the kernels below, one
+ * span at a time. init_blend() picks the best versions the CPU supports.
+ * They all give exactly the same results as put_pixel(); x/255 is computed
+ * as (x + 1 + (x >> 8)) >> 8, which is exact for 0 <= x <= 255 * 255. */
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLEND_NEON
+#endif
+#include "splash.h"
+
+void (*blend_span)(u8 *dst, truecolor *src, int len);
+void (*blend_pm)(u8 *dst, pm_pixel *src, int len);
+void (*blend_mask)(u8 *dst, u8 *mask, int len, color c);
+void (*blend_gradient)(u8 *dst, int len, gradient *g);
+void (*blend_fade)(u8 *dst, u8 *from, u8 *to, int len, u8 a);
+
+static inline u32 gradient_pixel(gradient *g, int i, u8 *a)
+{
+	*a = (g->a + i * g->da) >> 16;
+	return (((g->r + i * g->dr) >> 16) << 16) |
+	       (((g->g + i * g->dg) >> 16) << 8) |
+		((g->b + i * g->db) >> 16);
+}
+
+static void blend_span_c(u8 *dst, truecolor *src, int len)
+{
+	for (; len > 0; len--, src++, dst += 4)
+		put_pixel(src->a, src->r, src->g, src->b, dst, dst);
+}
+
+#define div255(x)	(((x) + 1 + ((x) >> 8)) >> 8)
+
+static void blend_pm_c(u8 *dst, pm_pixel *src, int len)
+{
+	u32 *d = (u32*)dst, s;
+
+	for (; len > 0; len--, src++, d++) {
+		s = *d;
+		*d = (div255(((s >> 16) & 0xff) * src->ia + src->r) << 16) |
+		     (div255(((s >> 8) & 0xff) * src->ia + src->g) << 8) |
+		      div255((s & 0xff) * src->ia + src->b);
+	}
+}
+
+static void blend_mask_c(u8 *dst, u8 *mask, int len, color c)
+{
+	for (; len > 0; len--, mask++, dst += 4)
+		if (*mask)
+			put_pixel(c.a * *mask / 255, c.r, c.g, c.b, dst, dst);
+}
+
+static void blend_gradient_c(u8 *dst, int len, gradient *g)
+{
+	int i;
+	u32 p;
+	u8 a;
+
+	for (i = 0; i < len; i++, dst += 4) {
+		p = gradient_pixel(g, i, &a);
+		put_pixel(a, p >> 16, p >> 8, p, dst, dst);
+	}
+}
+
+/* dst = to at opacity a over from. Fades and cross-fades are made of these. */
+static void blend_fade_c(u8 *dst, u8 *from, u8 *to, int len, u8 a)
+{
+	u32 t;
+
+	for (; len > 0; len--, from += 4, to += 4, dst += 4) {
+		t = *(u32*)to;
+		put_pixel(a, t >> 16, t >> 8, t, from, dst);
+	}
+}
+
+#ifdef BLEND_X86
+/* Blends 4 pixels s over d, with alphas in the 32-bit lanes of a. */
+__attribute__((target("sse2")))
+static inline __m128i blend4_sse2(__m128i d, __m128i s, __m128i a)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i lo, hi, alo, ahi;
+
+	a = _mm_packs_epi32(a, a);
+	a = _mm_unpacklo_epi16(a, a);
+	alo = _mm_unpacklo_epi32(a, a);
+	ahi = _mm_unpackhi_epi32(a, a);
+
+	lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, z), _mm_sub_epi16(c255, alo)),
+			   _mm_mullo_epi16(_mm_unpacklo_epi8(s, z), alo));
+	hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, z), _mm_sub_epi16(c255, ahi)),
+			   _mm_mullo_epi16(_mm_unpackhi_epi8(s, z), ahi));
+	lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+
+	return _mm_and_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0x00ffffff));
+}
+
+/* x/255 in 32-bit lanes, for x <= 255 * 255 */
+__attribute__((target("sse2")))
+static inline __m128i div255_sse2(__m128i x)
+{
+	return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_set1_epi32(1)),
+					    _mm_srli_epi32(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void blend_span_sse2(u8 *dst, truecolor *src, int len)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi32(0xff);
+	__m128i v, a, s;
+
+	for (; len >= 4; len -= 4, src += 4, dst += 16) {
+		v = _mm_loadu_si128((__m128i*)src);
+		a = _mm_srli_epi32(v, 24);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, z)) == 0xffff)
+			continue;
+
+		/* RGBA bytes to 0x00RRGGBB */
+		s = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, ff), 16),
+			_mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xff00)),
+				     _mm_and_si128(_mm_srli_epi32(v, 16), ff)));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, ff)) != 0xffff)
+			s = blend4_sse2(_mm_loadu_si128((__m128i*)dst), s, a);
+		_mm_storeu_si128((__m128i*)dst, s);
+	}
+
+	blend_span_c(dst, src, len);
+}
+
+/* d * (255 - a) + c * a for the u16 lanes of 2 pixels, p holding the
+ * premultiplied pixels */
+__attribute__((target("sse2")))
+static inline __m128i pm2_sse2(__m128i d, __m128i p)
+{
+	__m128i ia = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, 0xff), 0xff);
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(d, ia), p);
+
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)),
+					    _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void blend_pm_sse2(u8 *dst, pm_pixel *src, int len)
+{
+	const __m128i z = _mm_setzero_si128();
+	__m128i d, lo, hi;
+
+	for (; len >= 4; len -= 4, src += 4, dst += 16) {
+		d = _mm_loadu_si128((__m128i*)dst);
+		lo = pm2_sse2(_mm_unpacklo_epi8(d, z), _mm_loadu_si128((__m128i*)src));
+		hi = pm2_sse2(_mm_unpackhi_epi8(d, z), _mm_loadu_si128((__m128i*)(src + 2)));
+		_mm_storeu_si128((__m128i*)dst, _mm_and_si128(_mm_packus_epi16(lo, hi),
+							      _mm_set1_epi32(0x00ffffff)));
+	}
+
+	blend_pm_c(dst, src, len);
+}
+
+__attribute__((target("sse2")))
+static void blend_mask_sse2(u8 *dst, u8 *mask, int len, color c)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i s = _mm_set1_epi32((c.r << 16) | (c.g << 8) | c.b);
+	const __m128i ca = _mm_set1_epi32(c.a);
+	__m128i m;
+	int t;
+
+	for (; len >= 4; len -= 4, mask += 4, dst += 16) {
+		memcpy(&t, mask, 4);
+		if (!t)
+			continue;
+
+		m = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(t), z), z);
+		m = div255_sse2(_mm_mullo_epi16(m, ca));
+		_mm_storeu_si128((__m128i*)dst, blend4_sse2(_mm_loadu_si128((__m128i*)dst), s, m));
+	}
+
+	blend_mask_c(dst, mask, len, c);
+}
+
+__attribute__((target("sse2")))
+static void blend_gradient_sse2(u8 *dst, int len, gradient *g)
+{
+	__m128i r, gg, b, a, dr, dg, db, da, s;
+	gradient t;
+	int opaque;
+
+	if (len < 4) {
+		blend_gradient_c(dst, len, g);
+		return;
+	}
+
+#define lanes(v, d, c, dc) \
+	v = _mm_setr_epi32(c, (c) + (dc), (c) + 2 * (dc), (c) + 3 * (dc)); \
+	d = _mm_set1_epi32(4 * (dc));
+
+	lanes(r, dr, g->r, g->dr);
+	lanes(gg, dg, g->g, g->dg);
+	lanes(b, db, g->b, g->db);
+	lanes(a, da, g->a, g->da);
+#undef lanes
+
+	/* Opaque spans are written without reading them first. */
+	opaque = (g->a >> 16) == 255 && !g->da;
+
+	t = *g;
+	for (; len >= 4; len -= 4, dst += 16) {
+		s = _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(r, 16), 16),
+		    _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(gg, 16), 8),
+				 _mm_srli_epi32(b, 16)));
+		if (!opaque)
+			s = blend4_sse2(_mm_loadu_si128((__m128i*)dst), s, _mm_srli_epi32(a, 16));
+		_mm_storeu_si128((__m128i*)dst, s);
+		r = _mm_add_epi32(r, dr);
+		gg = _mm_add_epi32(gg, dg);
+		b = _mm_add_epi32(b, db);
+		a = _mm_add_epi32(a, da);
+		t.r += 4 * t.dr; t.g += 4 * t.dg;
+		t.b += 4 * t.db; t.a += 4 * t.da;
+	}
+
+	blend_gradient_c(dst, len, &t);
+}
+
+__attribute__((target("sse2")))
+static void blend_fade_sse2(u8 *dst, u8 *from, u8 *to, int len, u8 a)
+{
+	const __m128i va = _mm_set1_epi32(a);
+
+	for (; len >= 4; len -= 4, from += 16, to += 16, dst += 16)
+		_mm_storeu_si128((__m128i*)dst, blend4_sse2(_mm_loadu_si128((__m128i*)from),
+							    _mm_loadu_si128((__m128i*)to), va));
+
+	blend_fade_c(dst, from, to, len, a);
+}
+
+/* As blend4_sse2(), 8 pixels at a time. The unpacks work within 128-bit
+ * lanes, so the pixels stay in order. */
+__attribute__((target("avx2")))
+static inline __m256i blend8_avx2(__m256i d, __m256i s, __m256i a)
+{
+	const __m256i z = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i one = _mm256_set1_epi16(1);
+	__m256i lo, hi, alo, ahi;
+
+	a = _mm256_packs_epi32(a, a);
+	a = _mm256_unpacklo_epi16(a, a);
+	alo = _mm256_unpacklo_epi32(a, a);
+	ahi = _mm256_unpackhi_epi32(a, a);
+
+	lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, z), _mm256_sub_epi16(c255, alo)),
+			      _mm256_mullo_epi16(_mm256_unpacklo_epi8(s, z), alo));
+	hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, z), _mm256_sub_epi16(c255, ahi)),
+			      _mm256_mullo_epi16(_mm256_unpackhi_epi8(s, z), ahi));
+	lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)), 8);
+	hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)), 8);
+
+	return _mm256_and_si256(_mm256_packus_epi16(lo, hi), _mm256_set1_epi32(0x00ffffff));
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2(u8 *dst, truecolor *src, int len)
+{
+	const __m256i ff = _mm256_set1_epi32(0xff);
+	__m256i v, a, s;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 32) {
+		v = _mm256_loadu_si256((__m256i*)src);
+		a = _mm256_srli_epi32(v, 24);
+
+		if (_mm256_testz_si256(a, a))
+			continue;
+
+		s = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v, ff), 16),
+		    _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi32(0xff00)),
+				    _mm256_and_si256(_mm256_srli_epi32(v, 16), ff)));
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, ff)) != -1)
+			s = blend8_avx2(_mm256_loadu_si256((__m256i*)dst), s, a);
+		_mm256_storeu_si256((__m256i*)dst, s);
+	}
+
+	blend_span_sse2(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pm4_avx2(__m256i d, __m256i p)
+{
+	__m256i ia = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p, 0xff), 0xff);
+	__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(d, ia), p);
+
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)),
+						  _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void blend_pm_avx2(u8 *dst, pm_pixel *src, int len)
+{
+	const __m256i z = _mm256_setzero_si256();
+	__m256i d, p0, p1, lo, hi;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 32) {
+		d = _mm256_loadu_si256((__m256i*)dst);
+		p0 = _mm256_loadu_si256((__m256i*)src);
+		p1 = _mm256_loadu_si256((__m256i*)(src + 4));
+
+		/* the unpacks give pixels 0, 1, 4, 5 and 2, 3, 6, 7 */
+		lo = pm4_avx2(_mm256_unpacklo_epi8(d, z), _mm256_permute2x128_si256(p0, p1, 0x20));
+		hi = pm4_avx2(_mm256_unpackhi_epi8(d, z), _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256((__m256i*)dst, _mm256_and_si256(_mm256_packus_epi16(lo, hi),
+								    _mm256_set1_epi32(0x00ffffff)));
+	}
+
+	blend_pm_sse2(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static void blend_mask_avx2(u8 *dst, u8 *mask, int len, color c)
+{
+	const __m256i s = _mm256_set1_epi32((c.r << 16) | (c.g << 8) | c.b);
+	const __m256i ca = _mm256_set1_epi32(c.a);
+	__m256i m;
+	long long t;
+
+	for (; len >= 8; len -= 8, mask += 8, dst += 32) {
+		memcpy(&t, mask, 8);
+		if (!t)
+			continue;
+
+		m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)mask));
+		m = _mm256_mullo_epi16(m, ca);
+		m = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(m, _mm256_set1_epi32(1)),
+						       _mm256_srli_epi32(m, 8)), 8);
+		_mm256_storeu_si256((__m256i*)dst, blend8_avx2(_mm256_loadu_si256((__m256i*)dst), s, m));
+	}
+
+	blend_mask_sse2(dst, mask, len, c);
+}
+
+__attribute__((target("avx2")))
+static void blend_fade_avx2(u8 *dst, u8 *from, u8 *to, int len, u8 a)
+{
+	const __m256i va = _mm256_set1_epi32(a);
+
+	for (; len >= 8; len -= 8, from += 32, to += 32, dst += 32)
+		_mm256_storeu_si256((__m256i*)dst, blend8_avx2(_mm256_loadu_si256((__m256i*)from),
+							       _mm256_loadu_si256((__m256i*)to), va));
+
+	blend_fade_sse2(dst, from, to, len, a);
+}
+#endif /* BLEND_X86 */
+
+#ifdef BLEND_NEON
+/* x/255 for 16-bit lanes, narrowed to 8 bits */
+static inline uint8x8_t div255_neon(uint16x8_t x)
+{
+	return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+}
+
+static inline uint8x8_t blend8_neon(uint8x8_t d, uint8x8_t s, uint8x8_t a)
+{
+	return div255_neon(vmlal_u8(vmull_u8(d, vsub_u8(vdup_n_u8(255), a)), s, a));
+}
+
+static void blend_span_neon(u8 *dst, truecolor *src, int len)
+{
+	uint8x8x4_t s, d;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 32) {
+		s = vld4_u8((u8*)src);	/* r, g, b, a */
+		d = vld4_u8(dst);	/* b, g, r, 0 */
+		d.val[0] = blend8_neon(d.val[0], s.val[2], s.val[3]);
+		d.val[1] = blend8_neon(d.val[1], s.val[1], s.val[3]);
+		d.val[2] = blend8_neon(d.val[2], s.val[0], s.val[3]);
+		d.val[3] = vdup_n_u8(0);
+		vst4_u8(dst, d);
+	}
+
+	blend_span_c(dst, src, len);
+}
+
+static void blend_pm_neon(u8 *dst, pm_pixel *src, int len)
+{
+	uint16x8x4_t s;
+	uint8x8x4_t d;
+	int k;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 32) {
+		s = vld4q_u16((u16*)src);	/* b, g, r, 255 - a */
+		d = vld4_u8(dst);
+		for (k = 0; k < 3; k++)
+			d.val[k] = div255_neon(vmlaq_u16(s.val[k], vmovl_u8(d.val[k]), s.val[3]));
+		d.val[3] = vdup_n_u8(0);
+		vst4_u8(dst, d);
+	}
+
+	blend_pm_c(dst, src, len);
+}
+
+static void blend_mask_neon(u8 *dst, u8 *mask, int len, color c)
+{
+	uint8x8x4_t d;
+	uint8x8_t a;
+
+	for (; len >= 8; len -= 8, mask += 8, dst += 32) {
+		a = vld1_u8(mask);
+		if (!vget_lane_u64(vreinterpret_u64_u8(a), 0))
+			continue;
+
+		a = div255_neon(vmull_u8(a, vdup_n_u8(c.a)));
+		d = vld4_u8(dst);
+		d.val[0] = blend8_neon(d.val[0], vdup_n_u8(c.b), a);
+		d.val[1] = blend8_neon(d.val[1], vdup_n_u8(c.g), a);
+		d.val[2] = blend8_neon(d.val[2], vdup_n_u8(c.r), a);
+		d.val[3] = vdup_n_u8(0);
+		vst4_u8(dst, d);
+	}
+
+	blend_mask_c(dst, mask, len, c);
+}
+
+static void blend_fade_neon(u8 *dst, u8 *from, u8 *to, int len, u8 a)
+{
+	const uint8x8_t va = vdup_n_u8(a);
+
+	/* Every byte gets the same treatment, the unused one stays 0 */
+	for (; len >= 2; len -= 2, from += 8, to += 8, dst += 8)
+		vst1_u8(dst, blend8_neon(vld1_u8(from), vld1_u8(to), va));
+
+	blend_fade_c(dst, from, to, len, a);
+}
+#endif /* BLEND_NEON */
+
+/* Turns straight RGBA pixels into premultiplied ones. */
+void pm_convert(pm_pixel *dst, truecolor *src, int len)
+{
+	for (; len > 0; len--, src++, dst++) {
+		dst->r = src->r * src->a;
+		dst->g = src->g * src->a;
+		dst->b = src->b * src->a;
+		dst->ia = 255 - src->a;
+	}
+}
+
+/* How pixel p goes into the runs. With q, the pixel it was before, what
+ * stays the same is skipped. */
+static inline int run_type(u8 *p, u8 *q, int depth)
+{
+	u8 a = p[depth - 1];
+
+	if (q && (*(u32*)p == *(u32*)q || (!a && !q[3])))
+		return RUN_SKIP;
+
+	return !a ? (q ? RUN_CLEAR : RUN_SKIP) : (a == 255) ? RUN_SOLID : RUN_BLEND;
+}
+
+/* Returns the bytes of pixel data stored, or -1. */
+static int rle_code(rle *r, u8 *src, u8 *prev, int w, int h, int pitch, int depth)
+{
+	u16 *run, *cnt;
+	u8 *data, *p;
+	int x, y, t, l;
+
+	if (!r->runs || r->w != w || r->h != h || r->depth != depth) {
+		rle_free(r);
+		r->runs = malloc((w + 1) * h * sizeof(u16));
+		r->data = malloc(w * h * (depth == 4 ? sizeof(pm_pixel) : 1));
+		r->row = malloc(2 * h * sizeof(u32));
+		if (!r->runs || (!r->data && w) || !r->row) {
+			rle_free(r);
+			return -1;
+		}
+		r->w = w;
+		r->h = h;
+		r->depth = depth;
+	}
+
+	run = r->runs;
+	data = r->data;
+
+	for (y = 0; y < h; y++, src += pitch, prev += prev ? pitch : 0) {
+		r->row[2 * y] = run - r->runs;
+		r->row[2 * y + 1] = data - r->data;
+		cnt = run++;
+		*cnt = 0;
+
+		for (x = 0; x < w; x += l) {
+			p = src + x * depth;
+			t = run_type(p, prev ? prev + x * depth : NULL, depth);
+
+			for (l = 1; x + l < w && l < RUN_LEN; l++)
+				if (t != run_type(p + l * depth, prev ? prev + (x + l) * depth : NULL, depth))
+					break;
+
+			*run++ = (t << 14) | l;
+			(*cnt)++;
+
+			if (t == RUN_BLEND && depth == 4) {
+				pm_convert((pm_pixel*)data, (truecolor*)p, l);
+				data += l * sizeof(pm_pixel);
+			} else if (t == RUN_BLEND) {
+				memcpy(data, p, l);
+				data += l;
+			} else if (t == RUN_SOLID && depth == 4) {
+				truecolor *c = (truecolor*)p;
+				u32 *d = (u32*)data;
+				int k;
+
+				for (k = 0; k < l; k++, c++)
+					*d++ = (c->r << 16) | (c->g << 8) | c->b;
+				data += l * 4;
+			}
+		}
+	}
+
+	return data - r->data;
+}
+
+/* Codes a w x h image as runs. depth is 4 for RGBA pixels and 1 for
+ * coverage masks. Opaque runs of RGBA pixels are stored ready to be copied
+ * and translucent ones premultiplied; opaque runs of masks don't need
+ * anything stored. The buffers of r are reused if it was coded from an
+ * image of the same size before. */
+int rle_encode(rle *r, u8 *src, int w, int h, int pitch, int depth)
+{
+	return rle_code(r, src, NULL, w, h, pitch, depth) < 0 ? -1 : 0;
+}
+/* Codes RGBA pixels as runs of what differs from prev, an image of the same
+ * size: what stays as it was is skipped, what turns transparent cleared. The
+ * buffers are cut down to what the runs take, so r is not to be coded into
+ * again. Returns the bytes it takes, or -1. */
+int rle_encode_delta(rle *r, u8 *src, u8 *prev, int w, int h, int pitch)
+{
+	int data, runs;
+	void *p;
+
+	if ((data = rle_code(r, src, prev, w, h, pitch, 4)) < 0)
+		return -1;
+
+	runs = h ? r->row[2 * h - 2] + 1 + r->runs[r->row[2 * h - 2]] : 0;
+	if ((p = realloc(r->runs, runs * sizeof(u16))))
+		r->runs = p;
+	if (!data) {
+		free(r->data);
+		r->data = NULL;
+	} else if ((p = realloc(r->data, data))) {
+		r->data = p;
+	}
+
+	return runs * sizeof(u16) + data + 2 * h * sizeof(u32);
+}
+
+/* Writes a delta back over the straight RGBA pixels it was coded against,
+ * which then hold the image it was coded from. */
+void rle_apply(u8 *dst, rle *r, int pitch)
+{
+	u16 *run = r->runs;
+	u8 *data = r->data;
+	truecolor *c;
+	pm_pixel *pm;
+	u32 *s;
+	int y, n, k, l, a;
+
+	for (y = 0; y < r->h; y++, dst += pitch) {
+		c = (truecolor*)dst;
+
+		for (n = *run++; n > 0; n--, run++) {
+			l = *run & RUN_LEN;
+
+			if ((*run >> 14) == RUN_SOLID) {
+				for (k = 0, s = (u32*)data; k < l; k++, s++) {
+					c[k].r = *s >> 16;
+					c[k].g = *s >> 8;
+					c[k].b = *s;
+					c[k].a = 255;
+				}
+				data += l * 4;
+			} else if ((*run >> 14) == RUN_BLEND) {
+				for (k = 0, pm = (pm_pixel*)data; k < l; k++, pm++) {
+					a = 255 - pm->ia;
+					c[k].r = pm->r / a;
+					c[k].g = pm->g / a;
+					c[k].b = pm->b / a;
+					c[k].a = a;
+				}
+				data += l * sizeof(pm_pixel);
+			} else if ((*run >> 14) == RUN_CLEAR) {
+				memset(c, 0, l * sizeof(*c));
+			}
+
+			c += l;
+		}
+	}
+}
+
+void rle_free(rle *r)
+{
+	free(r->runs);
+	free(r->data);
+	free(r->row);
+	memset(r, 0, sizeof(*r));
+}
+
+/* Draws the first len pixels of row y of an RGBA image. */
+void rle_blit(u8 *dst, rle *r, int y, int len)
+{
+	u16 *run = r->runs + r->row[2 * y];
+	u8 *data = r->data + r->row[2 * y + 1];
+	int n, l;
+
+	for (n = *run++; n > 0 && len > 0; n--, run++) {
+		l = min(*run & RUN_LEN, len);
+
+		if ((*run >> 14) == RUN_SOLID) {
+			memcpy(dst, data, l * 4);
+			data += (*run & RUN_LEN) * 4;
+		} else if ((*run >> 14) == RUN_BLEND) {
+			blend_pm(dst, (pm_pixel*)data, l);
+			data += (*run & RUN_LEN) * sizeof(pm_pixel);
+		}
+
+		dst += l * 4;
+		len -= l;
+	}
+}
+
+/* Draws the first len pixels of row y of a coverage mask in colour c. */
+void rle_blit_mask(u8 *dst, rle *r, int y, int len, color c)
+{
+	u16 *run = r->runs + r->row[2 * y];
+	u8 *data = r->data + r->row[2 * y + 1];
+	gradient g;
+	int n, l;
+
+	memset(&g, 0, sizeof(g));
+	g.r = c.r << 16; g.g = c.g << 16;
+	g.b = c.b << 16; g.a = c.a << 16;
+
+	for (n = *run++; n > 0 && len > 0; n--, run++) {
+		l = min(*run & RUN_LEN, len);
+
+		if ((*run >> 14) == RUN_SOLID) {
+			blend_gradient(dst, l, &g);
+		} else if ((*run >> 14) == RUN_BLEND) {
+			blend_mask(dst, data, l, c);
+			data += *run & RUN_LEN;
+		}
+
+		dst += l * 4;
+		len -= l;
+	}
+}
+
+/* Picks the kernels. Called from get_fb_settings(). */
+void init_blend()
+{
+	blend_span = blend_span_c;
+	blend_pm = blend_pm_c;
+	blend_mask = blend_mask_c;
+	blend_gradient = blend_gradient_c;
+	blend_fade = blend_fade_c;
+
+#if defined(BLEND_X86) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		blend_span = blend_span_sse2;
+		blend_pm = blend_pm_sse2;
+		blend_mask = blend_mask_sse2;
+		blend_gradient = blend_gradient_sse2;
+		blend_fade = blend_fade_sse2;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		blend_span = blend_span_avx2;
+		blend_pm = blend_pm_avx2;
+		blend_mask = blend_mask_avx2;
+		blend_fade = blend_fade_avx2;
+	}
+#elif defined(BLEND_NEON) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	blend_span = blend_span_neon;
+	blend_pm = blend_pm_neon;
+	blend_mask = blend_mask_neon;
+	blend_fade = blend_fade_neon;
+#endif
+}
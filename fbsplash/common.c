@@ -39,6 +39,8 @@ char *config_file = NULL;
 enum TASK arg_task = none; 
 int arg_fb = 0;
 int arg_vc = 0;
+int arg_rotate = -1;
+int arg_anim_cache = 0;		/* kB */
 char arg_mode = 'v';
 char *arg_theme = NULL;
 u16 arg_progress = 0;
@@ -48,10 +50,13 @@ u8 arg_kdmode = KD_TEXT;
 char *arg_export = NULL;
 #endif
 
-int bytespp = 4;		/* bytes per pixel */
-u8 fb_opt = 0;			/* can we use optimized 24/32bpp routines? */
-u8 fb_ro, fb_go, fb_bo; 	/* red, green, blue offset */
+int bytespp = 4;		/* bytes per pixel of the images we render to */
+int fb_bytespp = 4;		/* bytes per pixel on the framebuffer */
 u8 fb_rlen, fb_glen, fb_blen;	/* red, green, blue length */
+int fb_pages = 1;		/* screens the framebuffer can pan between */
+int fb_rotate;			/* how the image is turned on the screen */
+int fb_width, fb_height;	/* the screen's size; fb_var has the image's */
+static u32 orig_yres_virtual;
 
 struct fb_image pic;
 char *pic_file = NULL;
@@ -69,6 +74,72 @@ void detect_endianess(void)
 	DEBUG("This system is %s-endian.\n", (endianess == little) ? "little" : "big");
 }
 
+/* Makes room for a second screen below the visible one, if the driver can
+ * pan to it, so that frames can be flipped to rather than drawn over what
+ * is being shown. */
+static void probe_fb_pages(int fb)
+{
+	struct fb_var_screeninfo var;
+
+	fb_pages = 1;
+	orig_yres_virtual = fb_var.yres_virtual;
+
+	if (!fb_fix.ypanstep)
+		return;
+
+	if (fb_var.yres_virtual < 2 * fb_var.yres) {
+		var = fb_var;
+		var.yres_virtual = 2 * fb_var.yres;
+		var.activate = FB_ACTIVATE_NOW;
+		if (ioctl(fb, FBIOPUT_VSCREENINFO, &var) == -1 ||
+		    ioctl(fb, FBIOGET_VSCREENINFO, &var) == -1 ||
+		    ioctl(fb, FBIOGET_FSCREENINFO, &fb_fix) == -1)
+			return;
+		fb_var = var;
+	}
+
+	if (fb_var.yres_virtual >= 2 * fb_var.yres &&
+	    fb_fix.smem_len >= 2 * fb_var.yres * fb_fix.line_length)
+		fb_pages = 2;
+}
+
+/* Shows screen n of the framebuffer from the next vertical blank. */
+int pan_fb(int fd, int n)
+{
+	struct fb_var_screeninfo var = fb_var;
+
+	var.xres = fb_width;
+	var.yres = fb_height;
+	var.xoffset = 0;
+	var.yoffset = n * fb_height;
+	var.activate = FB_ACTIVATE_VBL;
+	if (ioctl(fd, FBIOPAN_DISPLAY, &var) == -1)
+		return -1;
+
+	fb_var.yoffset = var.yoffset;
+	return 0;
+}
+
+/* Goes back to showing the first screen, with the virtual size we found. */
+void reset_fb_pages(int fd)
+{
+	struct fb_var_screeninfo var;
+
+	if (fb_pages < 2)
+		return;
+
+	pan_fb(fd, 0);
+	if (fb_var.yres_virtual != orig_yres_virtual) {
+		var = fb_var;
+		var.xres = fb_width;
+		var.yres = fb_height;
+		var.yres_virtual = orig_yres_virtual;
+		var.activate = FB_ACTIVATE_NOW;
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &var) != -1)
+			fb_var.yres_virtual = orig_yres_virtual;
+	}
+}
+
 int get_fb_settings(int fb_num)
 {
 	char fn[32];
@@ -111,41 +182,63 @@ int get_fb_settings(int fb_num)
 		return 3;
 	}
 
+	probe_fb_pages(fb);
 	close(fb);
 
 #ifdef TARGET_KERNEL
 	remove_dev(fn, 0x1);
 #endif
-	bytespp = (fb_var.bits_per_pixel + 7) >> 3;
-
-	/* Check if optimized code can be used. We use special optimizations for
-	 * 24/32bpp modes in which all color components have a length of 8 bits. */
-	if (bytespp < 3 || fb_var.blue.length != 8 || fb_var.green.length != 8 || fb_var.red.length != 8) {
-		fb_opt = 0;
-
-		if (fb_fix.visual == FB_VISUAL_DIRECTCOLOR) {
-			fb_blen = fb_glen = fb_rlen = min(min(fb_var.red.length,fb_var.green.length),fb_var.blue.length);
-		} else {
-			fb_rlen = fb_var.red.length;
-			fb_glen = fb_var.green.length;
-			fb_blen = fb_var.blue.length;
-		}
+	init_fb_format();
+	return 0;
+}
+
+#ifndef TARGET_KERNEL
+/* How far the console is turned, in quarters clockwise. */
+static int fbcon_rotation()
+{
+	FILE *f;
+	int r = 0;
+
+	f = fopen(PATH_SYS "/class/graphics/fbcon/rotate", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%d", &r) != 1)
+		r = 0;
+	fclose(f);
+
+	return r & 3;
+}
+#endif
+
+/* Works out how we render and present in the mode described by fb_var and
+ * fb_fix. */
+void init_fb_format()
+{
+	/* The image is laid out the way the console is turned, unless told
+	 * otherwise, and fb_var describes it from here on. */
+	fb_width = fb_var.xres;
+	fb_height = fb_var.yres;
+	fb_rotate = FB_ROTATE_UR;
+#ifndef TARGET_KERNEL
+	fb_rotate = (arg_rotate >= 0) ? (arg_rotate & 3) : fbcon_rotation();
+	if (fb_rotate & 1) {
+		fb_var.xres = fb_height;
+		fb_var.yres = fb_width;
+	}
+#endif
+
+	fb_bytespp = (fb_var.bits_per_pixel + 7) >> 3;
+
+	if (fb_fix.visual == FB_VISUAL_DIRECTCOLOR) {
+		fb_blen = fb_glen = fb_rlen = min(min(fb_var.red.length,fb_var.green.length),fb_var.blue.length);
 	} else {
-		fb_opt = 1;
-
-		/* Compute component offsets (ie. indexes in an array of u8's) */
-		fb_ro = (fb_var.red.offset >> 3);
-		fb_go = (fb_var.green.offset >> 3);
-		fb_bo = (fb_var.blue.offset >> 3);
-			
-		if (endianess == big) {
-			fb_ro = bytespp - 1 - fb_ro;
-			fb_go = bytespp - 1 - fb_go;
-			fb_bo = bytespp - 1 - fb_bo;
-		}
+		fb_rlen = fb_var.red.length;
+		fb_glen = fb_var.green.length;
+		fb_blen = fb_var.blue.length;
 	}
 
-	return 0;
+	init_converter();
+	init_blend();
 }
 
 char *get_filepath(char *path) 
@@ -224,24 +317,31 @@ void vt_cursor_enable(int fd)
 	write(fd, "\e[?25h\e[?0c",11);
 }
 
-int open_fb()
+int open_fb_num(int n)
 {
 	char dev[32];
 	int c;
 	
-	sprintf(dev, PATH_DEV "/fb%d", arg_fb);
+	sprintf(dev, PATH_DEV "/fb%d", n);
 	if ((c = open(dev, O_RDWR)) == -1) {
-		sprintf(dev, PATH_DEV "/fb/%d", arg_fb);
-		if ((c = open(dev, O_RDWR)) == -1) {
-			printk("Failed to open " PATH_DEV "/fb%d or " 
-			         PATH_DEV "/fb/%d.\n", arg_fb, arg_fb);
-			return -1;
-		}
+		sprintf(dev, PATH_DEV "/fb/%d", n);
+		c = open(dev, O_RDWR);
 	}
 
 	return c;
 }
 
+int open_fb()
+{
+	int c;
+
+	if ((c = open_fb_num(arg_fb)) == -1)
+		printk("Failed to open " PATH_DEV "/fb%d or " 
+		         PATH_DEV "/fb/%d.\n", arg_fb, arg_fb);
+
+	return c;
+}
+
 int open_tty(int tty)
 {
 	char dev[32];
@@ -2,6 +2,11 @@
 #define CONFIG_TTF
 #define CONFIG_TTF_KERNEL
 #define CONFIG_FBSPLASH
+#ifndef NO_MNG
 #define CONFIG_MNG
+#endif
+#ifndef NO_KMS
+#define CONFIG_KMS
+#endif
 #define THEME_DIR 			"/etc/splash"
 #define SPLASH_FIFO			"/lib/splash/cache/.splash"
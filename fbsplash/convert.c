@@ -0,0 +1,610 @@
+/*
+ * convert.c - Conversion from the internal pixel format to the framebuffer's
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+/* Everything is rendered as 0x00RRGGBB words, native-endian. Only the spans
+ * that get presented are converted to whatever the framebuffer uses, with
+ * the converter picked once by get_fb_settings(). 8bpp modes are no
+ * different: the image is drawn in colour, and every pixel presented is
+ * looked up in a table of the nearest palette entries, made when the image
+ * and its palette are loaded.
+ *
+ * Framebuffers in device memory are usually mapped uncached or
+ * write-combining, so the rows for those are converted in a buffer first and
+ * then streamed out with non-temporal stores; the mapping is never read.
+ *
+ * On a rotated screen, the image is laid out the way it is seen and only
+ * turned while it is presented. Small tiles of it are transposed into rows
+ * of the screen, so that both are walked through a cache line at a time.
+ *
+ * If the mode changes under us after the atomic restore, there is no going
+ * back to the theme on disk; the image stays the size it was and is
+ * scaled to the screen (nearest neighbour) as it is presented. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "../userui.h"
+#include "splash.h"
+
+convert_fn fb_convert;
+
+static int stream;		/* rows are written with non-temporal stores */
+
+/* Rows are converted this many pixels at a time before they are streamed,
+ * in a buffer of whichever thread presents them. A whole number of cache
+ * lines in every format. */
+#define STREAM_CHUNK	256
+
+/* Rotated areas are turned ROT_COLS columns by up to ROT_ROWS rows at a
+ * time: a cache line of each image row in, ROT_COLS screen rows out. */
+#define ROT_COLS	16
+#define ROT_ROWS	64
+
+/* The palette index for each colour, by its top PALETTE_BITS bits of red,
+ * green and blue. */
+#define PALETTE_BITS	5
+static u8 palette_lut[1 << (3 * PALETTE_BITS)];
+
+/* The colours of the palette itself, hashed, so that they map back to their
+ * own entries however close together they are. */
+#define PALETTE_HASH	512
+static u32 palette_rgb[PALETTE_HASH];
+static short palette_idx[PALETTE_HASH];		/* -1 if free */
+
+/* Which image column or row each screen column and row shows, when
+ * scaling. With a quarter turn, screen columns show image rows. */
+static int *scale_x, *scale_y;
+
+/* test mode statistics: what present_row() wrote, and how long all the
+ * threads calling it took to */
+static unsigned long long present_bytes, present_ns;
+
+/* 2x2 ordered dither, like it was done in bootsplash; this makes the pics
+ * in 15/16bpp modes look much nicer. The pattern is:
+ * 303030303..
+ * 121212121.. */
+static const u8 dither[2][2] = { { 3, 0 }, { 1, 2 } };
+
+/* What gets added to a pixel at the given dither level before the channels
+ * are cut down. */
+static inline u32 dither_word(int add)
+{
+	return ((add * 2 + 1) << 16) | (add << 8) | (add * 2 + 1);
+}
+
+void convert_copy(u8 *dst, u8 *src, int len, int x, int y)
+{
+	memcpy(dst, src, len * bytespp);
+}
+
+static inline u32 pack_pixel(u32 p)
+{
+	return ((((p >> 16) & 0xff) >> (8 - fb_rlen)) << fb_var.red.offset) |
+	       ((((p >> 8) & 0xff) >> (8 - fb_glen)) << fb_var.green.offset) |
+	       (((p & 0xff) >> (8 - fb_blen)) << fb_var.blue.offset);
+}
+
+/* Adds the dither to each channel, saturating at 255. */
+static inline u32 dither_pixel(u32 p, u32 d)
+{
+	u32 r = ((p >> 16) & 0xff) + ((d >> 16) & 0xff);
+	u32 g = ((p >> 8) & 0xff) + ((d >> 8) & 0xff);
+	u32 b = (p & 0xff) + (d & 0xff);
+
+	return (CLAMP(r) << 16) | (CLAMP(g) << 8) | CLAMP(b);
+}
+
+static void convert_32(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u32 *s = (u32*)src, *d = (u32*)dst;
+
+	while (len--)
+		*d++ = pack_pixel(*s++);
+}
+
+/* 32bpp with red and blue swapped */
+static void convert_32_bgr(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u32 *s = (u32*)src, *d = (u32*)dst, p;
+
+#ifdef __SSE2__
+	const __m128i g = _mm_set1_epi32(0x0000ff00);
+	const __m128i rb = _mm_set1_epi32(0x000000ff);
+
+	for (; len >= 4; len -= 4, s += 4, d += 4) {
+		__m128i v = _mm_loadu_si128((__m128i*)s);
+		__m128i o = _mm_and_si128(v, g);
+		o = _mm_or_si128(o, _mm_and_si128(_mm_srli_epi32(v, 16), rb));
+		o = _mm_or_si128(o, _mm_slli_epi32(_mm_and_si128(v, rb), 16));
+		_mm_storeu_si128((__m128i*)d, o);
+	}
+#endif
+	while (len--) {
+		p = *s++;
+		*d++ = (p & 0xff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+	}
+}
+
+static void convert_24(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u32 *s = (u32*)src, i;
+
+	while (len--) {
+		i = pack_pixel(*s++);
+		if (endianess == little) {
+			*(u16*)dst = i & 0xffff;
+			dst[2] = (i >> 16) & 0xff;
+		} else {
+			*(u16*)dst = (i >> 8) & 0xffff;
+			dst[2] = i & 0xff;
+		}
+		dst += 3;
+	}
+}
+
+/* Packed 24bpp, blue in the lowest byte: drop every fourth byte */
+static void convert_24_rgb(u8 *dst, u8 *src, int len, int x, int y)
+{
+	for (; len >= 4; len -= 4, src += 16, dst += 12) {
+		memcpy(dst, src, 3);
+		memcpy(dst + 3, src + 4, 3);
+		memcpy(dst + 6, src + 8, 3);
+		memcpy(dst + 9, src + 12, 3);
+	}
+
+	for (; len > 0; len--, src += 4, dst += 3)
+		memcpy(dst, src, 3);
+}
+
+/* 15/16bpp in any layout */
+static void convert_16(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u32 *s = (u32*)src;
+	u16 *d = (u16*)dst;
+	const u8 *add = dither[y & 1];
+
+	for (; len > 0; len--, x++)
+		*d++ = pack_pixel(dither_pixel(*s++, dither_word(add[x & 1])));
+}
+
+/* RGB565 */
+static void convert_565(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u32 *s = (u32*)src;
+	u16 *d = (u16*)dst;
+	const u8 *add = dither[y & 1];
+	u32 p;
+
+#ifdef __SSE2__
+	if (len >= 8) {
+		const __m128i dv = _mm_setr_epi32(dither_word(add[x & 1]),
+			dither_word(add[(x + 1) & 1]), dither_word(add[x & 1]),
+			dither_word(add[(x + 1) & 1]));
+		const __m128i r5 = _mm_set1_epi32(0xf800);
+		const __m128i g6 = _mm_set1_epi32(0x07e0);
+		const __m128i b5 = _mm_set1_epi32(0x001f);
+		__m128i v[2];
+		int k;
+
+		for (; len >= 8; len -= 8, s += 8, d += 8) {
+			for (k = 0; k < 2; k++) {
+				__m128i t = _mm_adds_epu8(_mm_loadu_si128((__m128i*)s + k), dv);
+				__m128i o = _mm_and_si128(_mm_srli_epi32(t, 8), r5);
+				o = _mm_or_si128(o, _mm_and_si128(_mm_srli_epi32(t, 5), g6));
+				o = _mm_or_si128(o, _mm_and_si128(_mm_srli_epi32(t, 3), b5));
+				/* sign-extend, so that packing doesn't saturate */
+				v[k] = _mm_srai_epi32(_mm_slli_epi32(o, 16), 16);
+			}
+			_mm_storeu_si128((__m128i*)d, _mm_packs_epi32(v[0], v[1]));
+		}
+	}
+#endif
+	for (; len > 0; len--, x++) {
+		p = dither_pixel(*s++, dither_word(add[x & 1]));
+		*d++ = ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+	}
+}
+
+static inline int palette_cell(u32 p)
+{
+	return ((p >> (24 - 3 * PALETTE_BITS)) & (((1 << PALETTE_BITS) - 1) << (2 * PALETTE_BITS))) |
+	       ((p >> (16 - 2 * PALETTE_BITS)) & (((1 << PALETTE_BITS) - 1) << PALETTE_BITS)) |
+	       ((p >> (8 - PALETTE_BITS)) & ((1 << PALETTE_BITS) - 1));
+}
+
+static inline int palette_hash(u32 p)
+{
+	return (p * 2654435761u) >> 23;		/* 9 bits, PALETTE_HASH */
+}
+
+static inline u8 palette_index(u32 p)
+{
+	int h;
+
+	p &= 0xffffff;
+	for (h = palette_hash(p); palette_idx[h] >= 0; h = (h + 1) & (PALETTE_HASH - 1))
+		if (palette_rgb[h] == p)
+			return palette_idx[h];
+
+	return palette_lut[palette_cell(p)];
+}
+
+static void convert_8(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u32 *s = (u32*)src;
+
+	while (len--)
+		*dst++ = palette_index(*s++);
+}
+
+/* Fills the tables convert_8() looks colours up in, from the palette the
+ * 8bpp image came with. The palette's own colours go in the hash, so that
+ * what wasn't drawn over comes out as it went in, and every cell of the LUT
+ * gets the entry nearest to its middle. */
+void init_palette_lut(struct fb_cmap *cmap)
+{
+	int cells = 1 << PALETTE_BITS, half = 1 << (7 - PALETTE_BITS);
+	int r, g, b, i, h, best, dr, dg, db, d, dmin;
+	u8 *l = palette_lut;
+	u32 p;
+
+	for (h = 0; h < PALETTE_HASH; h++)
+		palette_idx[h] = -1;
+
+	/* A colour that is in the palette twice keeps its first entry */
+	for (i = 0; i < cmap->len; i++) {
+		p = ((cmap->red[i] >> 8) << 16) | ((cmap->green[i] >> 8) << 8) |
+		    (cmap->blue[i] >> 8);
+		for (h = palette_hash(p); palette_idx[h] >= 0 && palette_rgb[h] != p;
+		     h = (h + 1) & (PALETTE_HASH - 1));
+		if (palette_idx[h] < 0) {
+			palette_rgb[h] = p;
+			palette_idx[h] = cmap->start + i;
+		}
+	}
+
+	for (r = 0; r < cells; r++)
+	for (g = 0; g < cells; g++)
+	for (b = 0; b < cells; b++) {
+		best = 0;
+		dmin = 0x7fffffff;
+		for (i = 0; i < cmap->len; i++) {
+			dr = (cmap->red[i] >> 8) - ((r << (8 - PALETTE_BITS)) + half);
+			dg = (cmap->green[i] >> 8) - ((g << (8 - PALETTE_BITS)) + half);
+			db = (cmap->blue[i] >> 8) - ((b << (8 - PALETTE_BITS)) + half);
+			d = dr * dr + dg * dg + db * db;
+			if (d < dmin) {
+				dmin = d;
+				best = i;
+			}
+		}
+		*l++ = cmap->start + best;
+	}
+}
+
+/* Copies n bytes to framebuffer memory, in whole 64-byte lines that bypass
+ * the caches where possible. */
+static void stream_copy(u8 *dst, u8 *src, int n)
+{
+#ifdef __SSE2__
+	int k = min((int)(-(unsigned long)dst & 63), n);
+
+	memcpy(dst, src, k);
+	dst += k; src += k; n -= k;
+
+	for (; n >= 64; n -= 64, src += 64, dst += 64) {
+		__m128i a = _mm_loadu_si128((__m128i*)src);
+		__m128i b = _mm_loadu_si128((__m128i*)src + 1);
+		__m128i c = _mm_loadu_si128((__m128i*)src + 2);
+		__m128i d = _mm_loadu_si128((__m128i*)src + 3);
+		_mm_stream_si128((__m128i*)dst, a);
+		_mm_stream_si128((__m128i*)dst + 1, b);
+		_mm_stream_si128((__m128i*)dst + 2, c);
+		_mm_stream_si128((__m128i*)dst + 3, d);
+	}
+#endif
+	memcpy(dst, src, n);
+}
+
+/* Writes a span of the rendered image at (x, y) to framebuffer memory. Calls
+ * have to be followed by present_flush(). */
+void present_row(u8 *dst, u8 *src, int len, int x, int y)
+{
+	u8 buf[STREAM_CHUNK * 4];
+	struct timespec t0, t1;
+	int n;
+
+	if (test_run) {
+		__sync_fetch_and_add(&present_bytes, len * fb_bytespp);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	}
+
+	if (!stream) {
+		fb_convert(dst, src, len, x, y);
+	} else if (fb_convert == convert_copy) {
+		stream_copy(dst, src, len * fb_bytespp);
+	} else {
+		for (; len > 0; len -= n, x += n) {
+			n = min(len, STREAM_CHUNK);
+			fb_convert(buf, src, n, x, y);
+			stream_copy(dst, buf, n * fb_bytespp);
+			src += n * bytespp;
+			dst += n * fb_bytespp;
+		}
+	}
+
+	if (test_run) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		__sync_fetch_and_add(&present_ns, (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+				     t1.tv_nsec - t0.tv_nsec);
+	}
+}
+
+/* Where the area r of the image is on the screen. */
+void rotate_rect(rect *r)
+{
+	int w = fb_var.xres, h = fb_var.yres;
+	rect o = *r;
+
+	switch (fb_rotate) {
+	case FB_ROTATE_CW:
+		r->x1 = h - 1 - o.y2;
+		r->x2 = h - 1 - o.y1;
+		r->y1 = o.x1;
+		r->y2 = o.x2;
+		break;
+	case FB_ROTATE_UD:
+		r->x1 = w - 1 - o.x2;
+		r->x2 = w - 1 - o.x1;
+		r->y1 = h - 1 - o.y2;
+		r->y2 = h - 1 - o.y1;
+		break;
+	case FB_ROTATE_CCW:
+		r->x1 = o.y1;
+		r->x2 = o.y2;
+		r->y1 = w - 1 - o.x2;
+		r->y2 = w - 1 - o.x1;
+		break;
+	}
+}
+
+/* Like present_row() for the w x h pixels of the image at src, which are at
+ * (x, y) in it, on a screen turned by fb_rotate. fb is where the screen
+ * starts. */
+void present_rotated(u8 *fb, u8 *src, int w, int h, int x, int y)
+{
+	u32 tile[ROT_COLS][ROT_ROWS];
+	u8 *s, *t;
+	int img_line_length = fb_var.xres * bytespp;
+	int cw = (fb_rotate == FB_ROTATE_CW);
+	int i, j, k, m, n, tw, th, px, py;
+
+	if (fb_rotate == FB_ROTATE_UD) {
+		/* Rows stay rows, back to front */
+		t = (u8*)tile;
+		for (j = 0; j < h; j++, src += img_line_length) {
+			py = fb_var.yres - 1 - (y + j);
+			for (i = 0; i < w; i += n) {
+				n = min(w - i, ROT_COLS * ROT_ROWS);
+				s = src + (i + n - 1) * bytespp;
+				for (k = 0; k < n; k++)
+					((u32*)t)[k] = ((u32*)s)[-k];
+				px = fb_var.xres - (x + i + n);
+				present_row(fb + py * fb_fix.line_length + px * fb_bytespp,
+					    t, n, px, py);
+			}
+		}
+		return;
+	}
+
+	/* Columns become rows: top to bottom turned clockwise is right to
+	 * left, counter-clockwise it is left to right */
+	for (i = 0; i < w; i += ROT_COLS) {
+		tw = min(w - i, ROT_COLS);
+		for (j = 0; j < h; j += ROT_ROWS) {
+			th = min(h - j, ROT_ROWS);
+
+			for (n = 0; n < th; n++) {
+				s = src + (j + n) * img_line_length + i * bytespp;
+				k = cw ? th - 1 - n : n;
+				for (m = 0; m < tw; m++)
+					tile[m][k] = ((u32*)s)[m];
+			}
+
+			for (n = 0; n < tw; n++) {
+				if (cw) {
+					py = x + i + n;
+					px = fb_var.yres - (y + j + th);
+				} else {
+					py = fb_var.xres - 1 - (x + i + n);
+					px = y + j;
+				}
+				present_row(fb + py * fb_fix.line_length + px * fb_bytespp,
+					    (u8*)tile[n], th, px, py);
+			}
+		}
+	}
+}
+
+/* Sets up scaling the image to a screen of w x h, seen the way the image
+ * is turned. */
+int init_scaler(int w, int h)
+{
+	int i, sw = fb_width, sh = fb_height;
+	int iw = fb_var.xres, ih = fb_var.yres;
+
+	free_scaler();
+	scale_x = malloc(sw * sizeof(int));
+	scale_y = malloc(sh * sizeof(int));
+	if (!scale_x || !scale_y) {
+		free_scaler();
+		return -1;
+	}
+
+	for (i = 0; i < sw; i++) {
+		switch (fb_rotate) {
+		case FB_ROTATE_UR:  scale_x[i] = i * iw / w; break;
+		case FB_ROTATE_CW:  scale_x[i] = (h - 1 - i) * ih / h; break;
+		case FB_ROTATE_UD:  scale_x[i] = (w - 1 - i) * iw / w; break;
+		case FB_ROTATE_CCW: scale_x[i] = i * ih / h; break;
+		}
+	}
+
+	for (i = 0; i < sh; i++) {
+		switch (fb_rotate) {
+		case FB_ROTATE_UR:  scale_y[i] = i * ih / h; break;
+		case FB_ROTATE_CW:  scale_y[i] = i * iw / w; break;
+		case FB_ROTATE_UD:  scale_y[i] = (h - 1 - i) * ih / h; break;
+		case FB_ROTATE_CCW: scale_y[i] = (w - 1 - i) * iw / w; break;
+		}
+	}
+
+	return 0;
+}
+
+void free_scaler()
+{
+	free(scale_x);
+	free(scale_y);
+	scale_x = scale_y = NULL;
+}
+
+/* The screen positions in 0..n-1 whose map entry is in a1..a2. */
+static void scaled_span(int *map, int n, int a1, int a2, int *p1, int *p2)
+{
+	int i;
+
+	*p1 = n;
+	*p2 = -1;
+	for (i = 0; i < n; i++) {
+		if (map[i] < a1 || map[i] > a2)
+			continue;
+		if (i < *p1)
+			*p1 = i;
+		*p2 = i;
+	}
+}
+
+/* Like present_row() for the area r of the image img, scaled to the screen
+ * at fb. r is set to the area of the screen it covers. */
+void present_scaled(u8 *fb, u8 *img, rect *r)
+{
+	u32 buf[STREAM_CHUNK];
+	u8 *p;
+	int img_line_length = fb_var.xres * bytespp;
+	int swap = fb_rotate & 1;
+	int px, py, i, n;
+	rect o = *r;
+
+	if (swap) {
+		scaled_span(scale_x, fb_width, o.y1, o.y2, &r->x1, &r->x2);
+		scaled_span(scale_y, fb_height, o.x1, o.x2, &r->y1, &r->y2);
+	} else {
+		scaled_span(scale_x, fb_width, o.x1, o.x2, &r->x1, &r->x2);
+		scaled_span(scale_y, fb_height, o.y1, o.y2, &r->y1, &r->y2);
+	}
+
+	for (py = r->y1; py <= r->y2; py++) {
+		for (px = r->x1; px <= r->x2; px += n) {
+			n = min(r->x2 - px + 1, STREAM_CHUNK);
+			for (i = 0; i < n; i++) {
+				/* A column of the image, or along a row */
+				if (swap)
+					p = img + scale_x[px + i] * img_line_length +
+					    scale_y[py] * bytespp;
+				else
+					p = img + scale_y[py] * img_line_length +
+					    scale_x[px + i] * bytespp;
+				buf[i] = *(u32*)p;
+			}
+			present_row(fb + py * fb_fix.line_length + px * fb_bytespp,
+				    (u8*)buf, n, px, py);
+		}
+	}
+}
+
+/* Makes sure whatever the calling thread presented has reached the
+ * framebuffer. */
+void present_flush()
+{
+#ifdef __SSE2__
+	if (stream)
+		_mm_sfence();
+#endif
+}
+
+/* Tells how fast the framebuffer could be written to, in test mode. */
+void present_report()
+{
+	if (!test_run || !present_ns)
+		return;
+
+	printk("fbsplash: took %llu ms writing %llu kB to the framebuffer, %.2f GB/s (%s).\n",
+	       present_ns / 1000000, present_bytes >> 10,
+	       (double)present_bytes / present_ns, stream ? "streamed" : "direct");
+	present_bytes = present_ns = 0;
+}
+
+/* Drivers whose fbdev mapping is known to be ordinary cached memory: DRM
+ * fbdev emulations that keep a shadow buffer and copy it out themselves,
+ * and vfb. Device memory is write-combined or uncached, and most drivers
+ * don't report where their framebuffer is, so anything else is taken to
+ * be device memory. */
+static const char *ram_fbs[] = {
+	"virtio_gpudrmfb", "simpledrmdrmfb", "hyperv_drmdrmfb", "qxldrmfb",
+	"cirrusdrmfb", "udldrmfb", "guddrmfb", "Virtual FB", NULL
+};
+
+int fb_in_ram(struct fb_fix_screeninfo *fix)
+{
+	int i;
+
+	for (i = 0; ram_fbs[i]; i++)
+		if (!strncmp(fix->id, ram_fbs[i], sizeof(fix->id)))
+			return 1;
+	return 0;
+}
+
+/* Picks the converter for the current mode. Called from get_fb_settings(). */
+void init_converter()
+{
+	int bpp = fb_var.bits_per_pixel;
+	int std = fb_rlen == 8 && fb_glen == 8 && fb_blen == 8 &&
+		  fb_var.green.offset == 8;
+
+	if (bpp == 8) {
+		fb_convert = convert_8;
+	} else if (bpp == 32 && std && fb_var.red.offset == 16 && fb_var.blue.offset == 0) {
+		fb_convert = convert_copy;
+	} else if (bpp == 32 && std && fb_var.red.offset == 0 && fb_var.blue.offset == 16) {
+		fb_convert = convert_32_bgr;
+	} else if (bpp == 32) {
+		fb_convert = convert_32;
+	} else if (bpp == 24 && std && endianess == little &&
+		   fb_var.red.offset == 16 && fb_var.blue.offset == 0) {
+		fb_convert = convert_24_rgb;
+	} else if (bpp == 24) {
+		fb_convert = convert_24;
+	} else if (fb_rlen == 5 && fb_glen == 6 && fb_blen == 5 &&
+		   fb_var.red.offset == 11 && fb_var.green.offset == 5 &&
+		   fb_var.blue.offset == 0) {
+		fb_convert = convert_565;
+	} else {
+		fb_convert = convert_16;
+	}
+
+	stream = 0;
+#ifdef __SSE2__
+	if (!fb_in_ram(&fb_fix))
+		stream = 1;
+#endif
+}
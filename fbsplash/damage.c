@@ -0,0 +1,199 @@
+/*
+ * damage.c - Tracking of the screen areas touched by rendering
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <string.h>
+#include "splash.h"
+
+/* Areas of the silent image that differ from the framebuffer contents. */
+damage fb_damage;
+
+/* Areas of the silent image that objects were drawn over since the base image
+ * was last restored. */
+damage obj_damage;
+
+/* Where the calling thread records what it draws to instead, if set. */
+__thread damage_set *local_damage;
+
+static inline int rect_area(rect *r)
+{
+	return (r->x2 - r->x1 + 1) * (r->y2 - r->y1 + 1);
+}
+
+static inline void rect_union(rect *r, rect *a, rect *b)
+{
+	r->x1 = min(a->x1, b->x1);
+	r->y1 = min(a->y1, b->y1);
+	r->x2 = max(a->x2, b->x2);
+	r->y2 = max(a->y2, b->y2);
+}
+
+void damage_clear(damage *d)
+{
+	d->cnt = 0;
+}
+
+void damage_all(damage *d)
+{
+	d->cnt = 1;
+	d->r[0].x1 = 0;
+	d->r[0].y1 = 0;
+	d->r[0].x2 = fb_var.xres - 1;
+	d->r[0].y2 = fb_var.yres - 1;
+}
+
+/* Adds a rectangle (inclusive coordinates) to the damage list. Overlapping
+ * or touching rectangles are merged as long as that doesn't make us copy
+ * much more than we have to. When the list is full, the new rectangle is
+ * merged with whichever entry grows the least. */
+void damage_add(damage *d, int x1, int y1, int x2, int y2)
+{
+	rect n, u;
+	int i, best, cost, best_cost;
+
+	n.x1 = max(x1, 0);
+	n.y1 = max(y1, 0);
+	n.x2 = min(x2, (int)fb_var.xres - 1);
+	n.y2 = min(y2, (int)fb_var.yres - 1);
+
+	if (n.x1 > n.x2 || n.y1 > n.y2)
+		return;
+
+again:
+	for (i = 0; i < d->cnt; i++) {
+		rect *r = &d->r[i];
+
+		if (r->x1 > n.x2 + 1 || n.x1 > r->x2 + 1 ||
+		    r->y1 > n.y2 + 1 || n.y1 > r->y2 + 1)
+			continue;
+
+		rect_union(&u, r, &n);
+		if (rect_area(&u) > rect_area(r) + rect_area(&n))
+			continue;
+
+		/* Merge, then retry in case the union now touches others. */
+		n = u;
+		d->r[i] = d->r[--d->cnt];
+		goto again;
+	}
+
+	if (d->cnt < MAX_DAMAGE) {
+		d->r[d->cnt++] = n;
+		return;
+	}
+
+	best = 0;
+	best_cost = -1;
+	for (i = 0; i < d->cnt; i++) {
+		rect_union(&u, &d->r[i], &n);
+		cost = rect_area(&u) - rect_area(&d->r[i]);
+		if (best_cost < 0 || cost < best_cost) {
+			best = i;
+			best_cost = cost;
+		}
+	}
+
+	rect_union(&n, &d->r[best], &n);
+	d->r[best] = d->r[--d->cnt];
+	goto again;
+}
+
+/* Rows of the images damage_diff() looks at together */
+#define DIFF_ROWS	16
+
+/* Adds where the images a and b differ: for every few rows, the span from
+ * the first to the last pixel that does. */
+void damage_diff(damage *d, u8 *a, u8 *b)
+{
+	int w = fb_var.xres, x, x1, x2, y, y1, y2;
+	u32 *p, *q;
+
+	for (y1 = 0; y1 < fb_var.yres; y1 += DIFF_ROWS) {
+		y2 = min(y1 + DIFF_ROWS, (int)fb_var.yres) - 1;
+		x1 = w;
+		x2 = -1;
+		for (y = y1; y <= y2; y++) {
+			p = (u32*)a + y * w;
+			q = (u32*)b + y * w;
+			if (!memcmp(p, q, w * 4))
+				continue;
+			for (x = 0; x < x1 && p[x] == q[x]; x++);
+			x1 = x;
+			for (x = w - 1; x > x2 && p[x] == q[x]; x--);
+			x2 = x;
+		}
+		if (x1 <= x2)
+			damage_add(d, x1, y1, x2, y2);
+	}
+}
+
+/* Records an area drawn to in the lists given by what (DMG_*). */
+void add_damage(int what, int x1, int y1, int x2, int y2)
+{
+	damage_set *s = local_damage;
+
+	if (s) {
+		if (what & DMG_FB)
+			damage_add(&s->fb, x1, y1, x2, y2);
+		if (what & DMG_OBJ)
+			damage_add(&s->obj, x1, y1, x2, y2);
+		if (what & DMG_BARS)
+			damage_add(&s->bars, x1, y1, x2, y2);
+		return;
+	}
+
+	if (what & DMG_FB)
+		damage_add(&fb_damage, x1, y1, x2, y2);
+	if (what & DMG_OBJ)
+		damage_add(&obj_damage, x1, y1, x2, y2);
+	if (what & DMG_BARS)
+		bars_damage(x1, y1, x2, y2);
+}
+
+/* Called by the rendering code for every area it draws to. */
+void mark_damage(int x1, int y1, int x2, int y2)
+{
+	add_damage(DMG_FB | DMG_OBJ | DMG_BARS, x1, y1, x2, y2);
+}
+
+/* Adds what a worker thread recorded to the global lists. */
+void merge_damage(damage_set *s)
+{
+	rect *r;
+	int i;
+
+	for (i = 0, r = s->fb.r; i < s->fb.cnt; i++, r++)
+		add_damage(DMG_FB, r->x1, r->y1, r->x2, r->y2);
+	for (i = 0, r = s->obj.r; i < s->obj.cnt; i++, r++)
+		add_damage(DMG_OBJ, r->x1, r->y1, r->x2, r->y2);
+	for (i = 0, r = s->bars.r; i < s->bars.cnt; i++, r++)
+		add_damage(DMG_BARS, r->x1, r->y1, r->x2, r->y2);
+}
+
+/* Copies the parts of the areas in d that lie in the current band back from
+ * the base image. */
+void restore_areas(u8 *target, u8 *src, damage *d)
+{
+	int i;
+	rect r;
+
+	for (i = 0; i < d->cnt; i++) {
+		r = d->r[i];
+		if (!band_clip(&r.y1, &r.y2))
+			continue;
+		prep_bgnd(target, src, r.x1, r.y1, r.x2 - r.x1 + 1, r.y2 - r.y1 + 1);
+		add_damage(DMG_FB, r.x1, r.y1, r.x2, r.y2);
+	}
+}
+
+/* Copies all areas objects were drawn over back from the base image. */
+void restore_damage(u8 *target, u8 *src)
+{
+	restore_areas(target, src, &obj_damage);
+	damage_clear(&obj_damage);
+}
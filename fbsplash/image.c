@@ -50,26 +50,22 @@ static int (*png_sig_cmp) PNGARG((png_bytep sig, png_size_t start,
 	png_size_t num_to_check));
 #endif
 
-/* This function converts a truecolor image to whatever format the 
- * framebuffer uses */
-void truecolor2fb (truecolor* data, u8* out, int len, int y, u8 alpha)
+/* This function converts a truecolor image to the format we render in;
+ * see convert.c for how it gets to the framebuffer */
+void truecolor2fb (truecolor* data, u8* out, int len, u8 alpha)
 {
-	int i, add = 0;
+	int i;
 	rgbcolor* rgb = (rgbcolor*)data;
 	
-	add ^= (0 ^ y) & 1 ? 1 : 3;
+	if (alpha) {
+		blend_span(out, data, len);
+		return;
+	}
 
 	for (i = 0; i < len; i++) {
-		if (alpha) {
-			put_pixel(data->a, data->r, data->g, data->b, out, out, add);
-			data++;
-		} else {
-			put_pixel(255, rgb->r, rgb->g, rgb->b, out, out, add);
-			rgb++;
-		}
-
+		*(u32*)out = (rgb->r << 16) | (rgb->g << 8) | rgb->b;
+		rgb++;
 		out += bytespp;
-		add ^= 3;
 	}
 }
 
@@ -82,13 +78,10 @@ int load_png(char *filename, u8 **data, struct fb_cmap *cmap, u32 *width, u32 *h
 	png_bytep 	row_pointer;
 	png_colorp 	palette;
 	int 		rowbytes, num_palette;
-	int 		i, j, bytespp = (fb_var.bits_per_pixel + 7) >> 3;
+	int 		i, j, bytespp = cmap ? 1 : 4;
 	u8 *buf = NULL;
 	u8 *t;
 	FILE *fp;
-
-	if (want_alpha)
-		bytespp = 4;
 	
 	fp = fopen(filename,"r");
 	if (!fp)
@@ -136,7 +129,7 @@ int load_png(char *filename, u8 **data, struct fb_cmap *cmap, u32 *width, u32 *h
 		png_set_strip_alpha(png_ptr);
 
 #ifndef TARGET_KERNEL	
-	if (!((png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_ALPHA) & want_alpha)) {
+	if (want_alpha && !(png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_ALPHA)) {
 		png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
 	}
 #endif
@@ -166,7 +159,12 @@ int load_png(char *filename, u8 **data, struct fb_cmap *cmap, u32 *width, u32 *h
 		*height = png_get_image_height(png_ptr, info_ptr);
 	}
 
-	*data = malloc(fb_var.xres * fb_var.yres * bytespp);
+	/* Images with alpha are drawn from where they are, the others are
+	 * screen buffers */
+	if (want_alpha)
+		*data = malloc(*width * *height * 4);
+	else
+		*data = malloc(fb_var.xres * fb_var.yres * bytespp);
 	if (!*data) {
 		printk("Failed to allocate memory for image: %s.\n", filename);
 		goto failed;
@@ -204,7 +202,7 @@ int load_png(char *filename, u8 **data, struct fb_cmap *cmap, u32 *width, u32 *h
 		
 		/* We only need to convert the image if we the alpha channel is not required */	
 		} else if (!want_alpha) {
-			truecolor2fb((truecolor*)buf, *data + png_get_image_width(png_ptr, info_ptr) * bytespp * i, png_get_image_width(png_ptr, info_ptr), i, 0);
+			truecolor2fb((truecolor*)buf, *data + png_get_image_width(png_ptr, info_ptr) * bytespp * i, png_get_image_width(png_ptr, info_ptr), 0);
 		}
 	}
 
@@ -248,7 +246,7 @@ int load_jpeg(char *filename, u8 **data, __u32 *width, __u32 *height)
 	FILE* injpeg;
 
 	u8 *buf = NULL;
-	int i, bytespp = (fb_var.bits_per_pixel+7) >> 3;
+	int i;
 	
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_decompress(&cinfo);
@@ -284,7 +282,7 @@ int load_jpeg(char *filename, u8 **data, __u32 *width, __u32 *height)
 	
 	for (i = 0; i < cinfo.output_height; i++) {
 		jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &buf, 1);
-		truecolor2fb((truecolor*)buf, *data + cinfo.output_width * bytespp * i, cinfo.output_width, i, 0);
+		truecolor2fb((truecolor*)buf, *data + cinfo.output_width * bytespp * i, cinfo.output_width, 0);
 	}
 
 	jpeg_finish_decompress(&cinfo);
@@ -295,6 +293,33 @@ int load_jpeg(char *filename, u8 **data, __u32 *width, __u32 *height)
 	return 0;
 }
 
+#ifdef CONFIG_PNG
+/* Replaces the palette indices of an 8bpp image with the colours they
+ * stand for. */
+static int expand_indexed(struct fb_image *img)
+{
+	u8 *in = (u8*)img->data;
+	u32 *out = malloc(img->width * img->height * 4);
+	int i, k;
+
+	if (!out)
+		return -1;
+
+	for (i = 0; i < img->width * img->height; i++) {
+		k = in[i] - img->cmap.start;
+		if (k < 0 || k >= img->cmap.len)
+			k = 0;
+		out[i] = ((img->cmap.red[k] >> 8) << 16) |
+			 ((img->cmap.green[k] >> 8) << 8) |
+			 (img->cmap.blue[k] >> 8);
+	}
+
+	free(in);
+	img->data = (char*)out;
+	return 0;
+}
+#endif
+
 int load_bg_images(char mode)
 {
 	struct fb_image *img = (mode == 'v') ? &verbose_img : &silent_img;
@@ -303,7 +328,7 @@ int load_bg_images(char mode)
 	
 	img->width = fb_var.xres;
 	img->height = fb_var.yres;
-	img->depth = fb_var.bits_per_pixel;
+	img->depth = bytespp * 8;
 
 	/* Deal with 8bpp modes. Only PNGs can be loaded, and pic256
 	 * option has to be used to specify the filename of the image */
@@ -347,6 +372,19 @@ int load_bg_images(char mode)
 			printk("Failed to load PNG file %s.\n", pic);
 			return -1;
 		}	
+
+		/* The kernel wants the verbose picture as palette indices. The
+		 * silent one is drawn over in colour like in any other mode, and
+		 * its palette picks the indices when it is presented. */
+		if (mode == 'v') {
+			img->depth = 8;
+		} else {
+			if (expand_indexed(img)) {
+				printk("Failed to allocate memory for image: %s.\n", pic);
+				return -4;
+			}
+			init_palette_lut(&img->cmap);
+		}
 #else
 		printk("This version of splashutils has been compiled without support for 8bpp modes.\n");
 		return -1;
@@ -374,6 +412,27 @@ int load_bg_images(char mode)
 			printk("Failed to load image %s.\n", pic);
 			return -1;
 		}
+
+		/* The kernel wants the verbose picture in the framebuffer's
+		 * format */
+		if (mode == 'v' && fb_convert != convert_copy) {
+			u8 *out = malloc(img->width * img->height * fb_bytespp);
+
+			if (!out) {
+				printk("Failed to allocate memory for image: %s.\n", pic);
+				free((u8*)img->data);
+				return -4;
+			}
+
+			for (i = 0; i < img->height; i++)
+				fb_convert(out + i * img->width * fb_bytespp,
+					   (u8*)img->data + i * img->width * bytespp,
+					   img->width, 0, i);
+
+			free((u8*)img->data);
+			img->data = (char*)out;
+			img->depth = fb_var.bits_per_pixel;
+		}
 	}
 
 	return 0;
@@ -401,6 +460,7 @@ int load_images(char mode)
 		for (i = icons.head; i != NULL; i = i->next) {
 			icon_img *ii = (icon_img*) i->p;
 			ii->w = ii->h = 0;
+			rle_free(&ii->runs);
 			
 			if (!is_png(ii->filename)) {
 				printk("Icon %s is not a PNG file.\n", ii->filename);
@@ -413,6 +473,9 @@ int load_images(char mode)
 				ii->w = ii->h = 0;
 				continue;
 			}
+
+			/* Falls back to blending every pixel if this fails. */
+			rle_encode(&ii->runs, ii->picbuf, ii->w, ii->h, ii->w * 4, 4);
 		}
 #endif
 	}
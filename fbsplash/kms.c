@@ -0,0 +1,406 @@
+/*
+ * kms.c - Output through DRM/KMS dumb buffers
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+/* For kernels that have no framebuffer device, or only a poor emulation of
+ * one, the silent image can be shown through the DRM device instead. We
+ * take the first connected output in its preferred mode and scan out one of
+ * two dumb buffers. Frames are presented to the other one, which is flipped
+ * to on the next vblank; drivers that need to be told what changed also get
+ * the damaged areas as dirty clips. If flipping doesn't work, we stick to
+ * the buffer that is shown. The buffers look just like a 32bpp framebuffer
+ * to the rest of the code, and fb_var/fb_fix are filled in to match. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../userui.h"
+#include "splash.h"
+
+#ifdef CONFIG_KMS
+
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+
+/* How long to wait for a flip before drawing to the buffer anyway, in ms */
+#define FLIP_TIMEOUT	100
+
+typedef struct {
+	u32 handle, fb_id, pitch;
+	__u64 size;
+	u8 *map;
+} kms_buf;
+
+static int kms_fd = -1;
+static int kms_card;
+static kms_buf bufs[2];
+static int back;		/* the buffer frames are presented to */
+static int flipping;		/* page flips work; otherwise back is shown */
+static int flip_pending;
+static int dirty_clips;		/* the driver wants to know what changed */
+
+static u32 crtc_id, conn_id;
+static struct drm_mode_modeinfo mode;
+static struct drm_mode_crtc saved;	/* whatever was shown before us */
+
+/* Finds a connected output, its preferred mode and a CRTC to drive it. */
+static int find_output()
+{
+	struct drm_mode_card_res res;
+	struct drm_mode_get_connector conn;
+	struct drm_mode_get_encoder enc;
+	struct drm_mode_modeinfo *modes = NULL;
+	u32 *crtcs = NULL, *conns = NULL, *encs = NULL;
+	int i, k, m, ret = -1;
+
+	memset(&res, 0, sizeof(res));
+	if (ioctl(kms_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == -1)
+		return -1;
+
+	crtcs = calloc(res.count_crtcs + 1, sizeof(u32));
+	conns = calloc(res.count_connectors + 1, sizeof(u32));
+	if (!crtcs || !conns)
+		goto out;
+
+	res.crtc_id_ptr = (unsigned long)crtcs;
+	res.connector_id_ptr = (unsigned long)conns;
+	res.count_fbs = res.count_encoders = 0;
+	if (ioctl(kms_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == -1)
+		goto out;
+
+	for (i = 0; i < res.count_connectors && ret; i++) {
+		memset(&conn, 0, sizeof(conn));
+		conn.connector_id = conns[i];
+		if (ioctl(kms_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == -1 ||
+		    conn.connection != DRM_MODE_CONNECTED || !conn.count_modes)
+			continue;
+
+		free(modes);
+		free(encs);
+		modes = calloc(conn.count_modes, sizeof(*modes));
+		encs = calloc(conn.count_encoders + 1, sizeof(u32));
+		if (!modes || !encs)
+			goto out;
+
+		conn.modes_ptr = (unsigned long)modes;
+		conn.encoders_ptr = (unsigned long)encs;
+		conn.count_props = 0;
+		if (ioctl(kms_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == -1 ||
+		    !conn.count_modes)
+			continue;
+
+		/* The CRTC the output is on now, or any it could be on */
+		crtc_id = 0;
+		for (k = -1; k < (int)conn.count_encoders && !crtc_id; k++) {
+			memset(&enc, 0, sizeof(enc));
+			enc.encoder_id = (k < 0) ? conn.encoder_id : encs[k];
+			if (!enc.encoder_id ||
+			    ioctl(kms_fd, DRM_IOCTL_MODE_GETENCODER, &enc) == -1)
+				continue;
+			if (k < 0) {
+				crtc_id = enc.crtc_id;
+				continue;
+			}
+			for (m = 0; m < res.count_crtcs; m++)
+				if (enc.possible_crtcs & (1 << m)) {
+					crtc_id = crtcs[m];
+					break;
+				}
+		}
+
+		if (!crtc_id)
+			continue;
+
+		for (m = 0; m < conn.count_modes - 1; m++)
+			if (modes[m].type & DRM_MODE_TYPE_PREFERRED)
+				break;
+		mode = modes[m];
+		conn_id = conn.connector_id;
+		ret = 0;
+	}
+
+out:
+	free(modes);
+	free(encs);
+	free(crtcs);
+	free(conns);
+	return ret;
+}
+
+static int create_buf(kms_buf *b)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_map_dumb map;
+	struct drm_mode_fb_cmd fb;
+
+	memset(&create, 0, sizeof(create));
+	create.width = mode.hdisplay;
+	create.height = mode.vdisplay;
+	create.bpp = 32;
+	if (ioctl(kms_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) == -1)
+		return -1;
+
+	b->handle = create.handle;
+	b->pitch = create.pitch;
+	b->size = create.size;
+
+	memset(&fb, 0, sizeof(fb));
+	fb.width = mode.hdisplay;
+	fb.height = mode.vdisplay;
+	fb.pitch = b->pitch;
+	fb.bpp = 32;
+	fb.depth = 24;
+	fb.handle = b->handle;
+	if (ioctl(kms_fd, DRM_IOCTL_MODE_ADDFB, &fb) == -1)
+		return -1;
+	b->fb_id = fb.fb_id;
+
+	memset(&map, 0, sizeof(map));
+	map.handle = b->handle;
+	if (ioctl(kms_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) == -1)
+		return -1;
+
+	b->map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      kms_fd, map.offset);
+	if (b->map == MAP_FAILED) {
+		b->map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void destroy_buf(kms_buf *b)
+{
+	struct drm_mode_destroy_dumb destroy;
+
+	if (b->map)
+		munmap(b->map, b->size);
+	if (b->fb_id)
+		ioctl(kms_fd, DRM_IOCTL_MODE_RMFB, &b->fb_id);
+	if (b->handle) {
+		destroy.handle = b->handle;
+		ioctl(kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	memset(b, 0, sizeof(*b));
+}
+
+static int set_crtc(u32 fb_id, struct drm_mode_modeinfo *m)
+{
+	struct drm_mode_crtc crtc;
+
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	crtc.fb_id = fb_id;
+	crtc.set_connectors_ptr = (unsigned long)&conn_id;
+	crtc.count_connectors = 1;
+	crtc.mode = *m;
+	crtc.mode_valid = 1;
+
+	return ioctl(kms_fd, DRM_IOCTL_MODE_SETCRTC, &crtc);
+}
+
+/* Sets up DRM card n for the silent image. Fills in fb_var and fb_fix like
+ * get_fb_settings() does. */
+/* Tells whether framebuffer n is the fbdev emulation of the DRM device we
+ * drive, going by their devices in sysfs. Without sysfs, we can't tell. */
+int kms_owns_fb(int n)
+{
+	char fb[64], card[64], fb_dev[PATH_MAX], card_dev[PATH_MAX];
+
+	sprintf(fb, PATH_SYS "/class/graphics/fb%d/device", n);
+	sprintf(card, PATH_SYS "/class/drm/card%d/device", kms_card);
+	if (!realpath(fb, fb_dev) || !realpath(card, card_dev))
+		return 0;
+	return !strcmp(fb_dev, card_dev);
+}
+
+int kms_open(int n)
+{
+	struct drm_get_cap cap;
+	char dev[32];
+
+	sprintf(dev, PATH_DEV "/dri/card%d", n);
+	kms_card = n;
+	kms_fd = open(dev, O_RDWR | O_CLOEXEC);
+	if (kms_fd == -1) {
+		printk("Failed to open %s.\n", dev);
+		return -1;
+	}
+
+	cap.capability = DRM_CAP_DUMB_BUFFER;
+	if (ioctl(kms_fd, DRM_IOCTL_GET_CAP, &cap) == -1 || !cap.value) {
+		printk("%s doesn't do dumb buffers.\n", dev);
+		goto fail;
+	}
+
+	/* Fails if someone else is master already; so will setting the mode */
+	ioctl(kms_fd, DRM_IOCTL_SET_MASTER, 0);
+
+	if (find_output()) {
+		printk("Couldn't find a connected output on %s.\n", dev);
+		goto fail;
+	}
+
+	memset(&saved, 0, sizeof(saved));
+	saved.crtc_id = crtc_id;
+	ioctl(kms_fd, DRM_IOCTL_MODE_GETCRTC, &saved);
+
+	if (create_buf(&bufs[0]) || create_buf(&bufs[1])) {
+		printk("Couldn't create buffers on %s.\n", dev);
+		goto fail;
+	}
+
+	if (set_crtc(bufs[0].fb_id, &mode) == -1) {
+		printk("Couldn't set mode %s on %s.\n", mode.name, dev);
+		goto fail;
+	}
+
+	back = 1;
+	flipping = 1;
+	flip_pending = 0;
+	dirty_clips = 1;
+
+	memset(&fb_var, 0, sizeof(fb_var));
+	memset(&fb_fix, 0, sizeof(fb_fix));
+	fb_var.xres = fb_var.xres_virtual = mode.hdisplay;
+	fb_var.yres = fb_var.yres_virtual = mode.vdisplay;
+	fb_var.bits_per_pixel = 32;
+	fb_var.red.offset = 16;
+	fb_var.green.offset = 8;
+	fb_var.red.length = fb_var.green.length = fb_var.blue.length = 8;
+	fb_fix.line_length = bufs[0].pitch;
+	fb_fix.smem_len = bufs[0].size;
+	fb_fix.visual = FB_VISUAL_TRUECOLOR;
+	fb_fix.type = FB_TYPE_PACKED_PIXELS;
+	strcpy(fb_fix.id, "kms");
+	init_fb_format();
+
+	printk("Using %s, %dx%d.\n", dev, mode.hdisplay, mode.vdisplay);
+	return 0;
+
+fail:
+	kms_close();
+	return -1;
+}
+
+/* The buffer to present the next frame to. */
+u8 *kms_buffer()
+{
+	return bufs[back].map;
+}
+
+/* Waits for the last flip, so that the buffer it flipped away from can be
+ * drawn to. */
+void kms_wait()
+{
+	struct pollfd pfd;
+	char buf[1024];
+	struct drm_event *e;
+	int len, i;
+
+	while (flip_pending) {
+		pfd.fd = kms_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, FLIP_TIMEOUT) <= 0)
+			break;
+
+		len = read(kms_fd, buf, sizeof(buf));
+		for (i = 0; i + (int)sizeof(*e) <= len; i += e->length) {
+			e = (struct drm_event*)(buf + i);
+			if (e->type == DRM_EVENT_FLIP_COMPLETE)
+				flip_pending = 0;
+			if (e->length < sizeof(*e))
+				break;
+		}
+		if (len <= 0)
+			break;
+	}
+
+	flip_pending = 0;
+}
+
+/* Shows the frame presented to kms_buffer(); d is what changed in it.
+ * Returns 1 if the buffers were flipped, and 0 if the frame was drawn to the
+ * buffer being shown. */
+int kms_present(damage *d)
+{
+	struct drm_clip_rect clips[MAX_DAMAGE];
+	struct drm_mode_fb_dirty_cmd dirty;
+	struct drm_mode_crtc_page_flip flip;
+	rect r;
+	int i;
+
+	if (dirty_clips && d->cnt) {
+		for (i = 0; i < d->cnt; i++) {
+			r = d->r[i];
+			rotate_rect(&r);
+			clips[i].x1 = r.x1;
+			clips[i].y1 = r.y1;
+			clips[i].x2 = r.x2 + 1;
+			clips[i].y2 = r.y2 + 1;
+		}
+
+		memset(&dirty, 0, sizeof(dirty));
+		dirty.fb_id = bufs[back].fb_id;
+		dirty.num_clips = d->cnt;
+		dirty.clips_ptr = (unsigned long)clips;
+		if (ioctl(kms_fd, DRM_IOCTL_MODE_DIRTYFB, &dirty) == -1 &&
+		    (errno == ENOSYS || errno == EINVAL))
+			dirty_clips = 0;
+	}
+
+	if (!flipping)
+		return 0;
+
+	memset(&flip, 0, sizeof(flip));
+	flip.crtc_id = crtc_id;
+	flip.fb_id = bufs[back].fb_id;
+	flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+	if (ioctl(kms_fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == -1) {
+		/* Show this one for good, and keep drawing to it. */
+		printk("Page flips don't work (%s), drawing to the visible buffer.\n",
+		       strerror(errno));
+		flipping = 0;
+		set_crtc(bufs[back].fb_id, &mode);
+		return 0;
+	}
+
+	flip_pending = 1;
+	back ^= 1;
+	return 1;
+}
+
+/* Puts back whatever was shown before and lets go of the device. */
+void kms_close()
+{
+	if (kms_fd == -1)
+		return;
+
+	kms_wait();
+
+	if (saved.fb_id && saved.mode_valid)
+		set_crtc(saved.fb_id, &saved.mode);
+
+	destroy_buf(&bufs[0]);
+	destroy_buf(&bufs[1]);
+
+	ioctl(kms_fd, DRM_IOCTL_DROP_MASTER, 0);
+	close(kms_fd);
+	kms_fd = -1;
+}
+
+#endif /* CONFIG_KMS */
@@ -84,8 +84,10 @@ static mng_ptr fb_mng_getcanvasline(mng_handle handle, mng_uint32 line_num)
 static mng_bool fb_mng_refresh(mng_handle handle, mng_uint32 x, mng_uint32 y,
 		mng_uint32 width, mng_uint32 height)
 {
+	mng_anim *mng = mng_get_userdata(handle);
 
-	/* FIXME */
+	/* The canvas has changed, it has to be converted again. */
+	mng->frame_valid = 0;
 	return MNG_TRUE;
 }
 
@@ -113,6 +115,7 @@ static mng_bool fb_mng_settimer(mng_handle handle, mng_uint32 msecs)
 	mng_anim *mng = mng_get_userdata(handle);
 
 	mng->wait_msecs = msecs;
+	mng->due = anim_clock() + msecs;
 	return MNG_TRUE;
 }
 
@@ -122,6 +125,8 @@ static mng_bool fb_mng_processheader(mng_handle handle, mng_uint32 width,
 	mng_anim *mng = mng_get_userdata(handle);
 
 	free(mng->canvas);
+	rle_free(&mng->frame);
+	mng->frame_valid = 0;
 
 	mng->canvas_bytes_pp = 4;
 
@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libmng.h>
 #include <unistd.h>
 #include "splash.h"
@@ -115,8 +116,109 @@ freemem_fail:
 	return MNG_NULL;
 }
 
+static void free_cache(mng_anim *mng)
+{
+	int k;
+
+	for (k = 0; k < mng->num_frames && mng->deltas; k++)
+		rle_free(&mng->deltas[k]);
+	free(mng->deltas);
+	free(mng->changed);
+	free(mng->delays);
+	mng->deltas = NULL;
+	mng->changed = NULL;
+	mng->delays = NULL;
+	mng->cached = 0;
+}
+
+/* Finds the part of the canvas a delta draws to. */
+static void delta_area(rle *r, rect *a)
+{
+	u16 *run = r->runs;
+	int x, y, n;
+
+	a->x1 = a->y1 = INT_MAX;
+	a->x2 = a->y2 = -1;
+
+	for (y = 0; y < r->h; y++) {
+		for (x = 0, n = *run++; n > 0; n--, run++) {
+			if ((*run >> 14) != RUN_SKIP) {
+				a->x1 = min(a->x1, x);
+				a->x2 = max(a->x2, x + (*run & RUN_LEN) - 1);
+				a->y1 = min(a->y1, y);
+				a->y2 = y;
+			}
+			x += *run & RUN_LEN;
+		}
+	}
+}
+
+/* Decodes every frame at once, so that they can then be drawn in any order
+ * without libmng. Each is kept as runs of what changes from the frame
+ * before, premultiplied like the other images. If they take more than
+ * *budget bytes, they are dropped and libmng goes on decoding the frames as
+ * they are shown; otherwise *budget is lowered by what they take. Returns 0
+ * if they are cached. */
+int mng_cache_frames(mng_handle mngh, long *budget)
+{
+	mng_anim *mng = mng_get_userdata(mngh);
+	int n = mng->num_frames, k, l;
+	int size = mng->canvas_w * mng->canvas_h * 4;
+	mng_retcode ret = MNG_NEEDTIMERWAIT;
+	long used;
+	u8 *prev;
+
+	if (n <= 0 || !mng->canvas)
+		return -1;
+
+	/* The frame before the first is transparent */
+	prev = calloc(1, size);
+	mng->deltas = calloc(n, sizeof(rle));
+	mng->changed = malloc(n * sizeof(rect));
+	mng->delays = malloc(n * sizeof(int));
+	if (!prev || !mng->deltas || !mng->changed || !mng->delays)
+		goto fail;
+
+	used = n * (sizeof(rle) + sizeof(rect) + sizeof(int));
+	for (k = 0; k < n && ret == MNG_NEEDTIMERWAIT; k++) {
+		ret = k ? mng_display_resume(mngh) : mng_display(mngh);
+		if (ret != MNG_NEEDTIMERWAIT && ret != MNG_NOERROR) {
+			print_mng_error(mngh, "mng_display failed");
+			goto fail;
+		}
+
+		l = rle_encode_delta(&mng->deltas[k], (u8*)mng->canvas, prev,
+				     mng->canvas_w, mng->canvas_h, mng->canvas_w * 4);
+		if (l < 0 || (used += l) > *budget)
+			goto fail;
+
+		delta_area(&mng->deltas[k], &mng->changed[k]);
+		mng->delays[k] = (ret == MNG_NEEDTIMERWAIT) ? mng->wait_msecs : -1;
+		memcpy(prev, mng->canvas, size);
+	}
+
+	free(prev);
+	*budget -= used;
+
+	mng->cached = k;
+	mng->canvas_at = k - 1;
+	mng->drawn = -1;
+	mng->displayed_first = 0;
+	return 0;
+
+fail:
+	free(prev);
+	free_cache(mng);
+	mng_display_restart(mngh);
+	return -1;
+}
+
 void mng_done(mng_handle mngh)
 {
+	mng_anim *mng = mng_get_userdata(mngh);
+
+	free_cache(mng);
+	rle_free(&mng->frame);
 	mng_cleanup(&mngh);
 }
 
@@ -126,6 +228,21 @@ mng_retcode mng_render_next(mng_handle mngh)
 	mng_retcode ret;
 	int last_frame = 0;
 
+	/* As libmng would: NOERROR once the last frame is shown, and for as
+	 * long as it is */
+	if (mng->cached) {
+		if (!mng->displayed_first)
+			mng->cur = 0;
+		else if (mng->cur + 1 < mng->cached && mng->delays[mng->cur] >= 0)
+			mng->cur++;
+		else
+			return MNG_NOERROR;
+
+		mng->displayed_first = 1;
+		mng->due = anim_clock() + max(mng->delays[mng->cur], 0);
+		return (mng->delays[mng->cur] < 0) ? MNG_NOERROR : MNG_NEEDTIMERWAIT;
+	}
+
 	/* last_frame = mng_get_currentframe(mngh) == mng->num_frames; FIXME */
 	if (!mng->displayed_first) {
 		ret = mng_display(mngh);
@@ -155,6 +272,17 @@ mng_retcode mng_render_proportional(mng_handle mngh, int progress)
 	if (frame_num > mng->num_frames)
 		frame_num = mng->num_frames;
 
+	/* Any frame is as close as any other */
+	if (mng->cached) {
+		frame_num = min(frame_num, mng->cached) - 1;
+		if (mng->displayed_first && mng->cur == frame_num)
+			return MNG_NOERROR;
+
+		mng->displayed_first = 1;
+		mng->cur = frame_num;
+		return MNG_NEEDTIMERWAIT;
+	}
+
 	if (!mng->displayed_first) {
 		ret = mng_display(mngh);
 		mng->displayed_first = 1;
@@ -191,11 +319,52 @@ mng_retcode mng_render_proportional(mng_handle mngh, int progress)
 	return ret;
 }
 
+/* Brings the canvas to cached frame k, through the deltas from the frame it
+ * holds, or from the first. */
+static void seek_canvas(mng_anim *mng, int k)
+{
+	int f = mng->canvas_at + 1;
+
+	if (k == mng->canvas_at)
+		return;
+
+	if (k < f) {
+		memset(mng->canvas, 0, mng->canvas_w * mng->canvas_h * 4);
+		f = 0;
+	}
+
+	for (; f <= k; f++)
+		rle_apply((u8*)mng->canvas, &mng->deltas[f], mng->canvas_w * 4);
+
+	mng->canvas_at = k;
+	mng->frame_valid = 0;
+}
+
+/* Gets the frame to be drawn ready, once, however many times it is
+ * displayed. With over, it is drawn over what is there: if that is the
+ * frame before it, only what changed is. */
+void mng_encode_frame(mng_handle mngh, int over)
+{
+	mng_anim *mng = mng_get_userdata(mngh);
+
+	if (mng->cached) {
+		mng->delta = over && mng->cur == mng->drawn + 1;
+		mng->drawn = mng->cur;
+		if (mng->delta)
+			return;
+		seek_canvas(mng, mng->cur);
+	}
+
+	if (!mng->frame_valid)
+		mng->frame_valid = !rle_encode(&mng->frame, (u8*)mng->canvas, mng->canvas_w,
+					       mng->canvas_h, mng->canvas_w * 4, 4);
+}
+
 int mng_display_next(mng_handle mngh, unsigned char* dest, int x, int y)
 {
 	truecolor *src;
 	mng_anim *mng = mng_get_userdata(mngh);
-	int dispwidth, dispheight, line;
+	int dispwidth, dispheight, line, y1, y2;
 
 	dest += y * fb_var.xres * bytespp;
 	src = (truecolor*)mng->canvas;
@@ -210,12 +379,49 @@ int mng_display_next(mng_handle mngh, unsigned char* dest, int x, int y)
 	else
 		dispheight = mng->canvas_h;
 
-	for (line = 0; line < dispheight; line++) {
-		truecolor2fb(src, dest + (x * bytespp), dispwidth, y + line, 1);
+	if (mng->delta) {
+		rect *c = &mng->changed[mng->cur];
+
+		/* Nothing changed */
+		if (c->y2 < 0 || c->x1 >= dispwidth)
+			return 1;
+
+		y1 = y + c->y1;
+		y2 = y + min(c->y2, dispheight - 1);
+		if (!band_clip(&y1, &y2))
+			return 1;
+
+		dest += (y1 - y) * fb_var.xres * bytespp;
+		for (line = y1 - y; line <= y2 - y; line++) {
+			rle_blit(dest + (x * bytespp), &mng->deltas[mng->cur], line, dispwidth);
+			dest += fb_var.xres * bytespp;
+		}
+
+		mark_damage(x + c->x1, y1, x + min(c->x2, dispwidth - 1), y2);
+		return 1;
+	}
+
+	if (!mng->cached)
+		mng_encode_frame(mngh, 0);
+
+	y1 = y;
+	y2 = y + dispheight - 1;
+	if (!band_clip(&y1, &y2))
+		return 1;
+
+	dest += (y1 - y) * fb_var.xres * bytespp;
+	src += (y1 - y) * mng->canvas_w;
+
+	for (line = y1 - y; line <= y2 - y; line++) {
+		if (mng->frame_valid)
+			rle_blit(dest + (x * bytespp), &mng->frame, line, dispwidth);
+		else
+			truecolor2fb(src, dest + (x * bytespp), dispwidth, 1);
 		dest += fb_var.xres * bytespp;
 		src  += mng->canvas_w;
 	}
 
+	mark_damage(x, y1, x + dispwidth - 1, y2);
 	return 1;
 }
 
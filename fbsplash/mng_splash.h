@@ -13,17 +13,32 @@ typedef struct {
 
 	char *canvas;
 	int canvas_h, canvas_w, canvas_bytes_pp;
+	rle frame;		/* the canvas, premultiplied */
+	int frame_valid;
 
 	int wait_msecs;
+	long due;		/* when the next frame is, by anim_clock() */
 	struct timeval start_time;
 	int displayed_first;
 	int num_frames;
+
+	/* Every frame, decoded at load by mng_cache_frames() */
+	rle *deltas;		/* what changes from the frame before */
+	rect *changed;		/* where that is on the canvas */
+	int *delays;		/* ms until the next one, -1 after the last */
+	int cached;		/* how many there are, 0 if not cached */
+	int cur;		/* the frame to draw next */
+	int drawn;		/* the frame drawn last */
+	int canvas_at;		/* the frame the canvas holds */
+	int delta;		/* draw just deltas[cur] */
 } mng_anim;
 
 /* mng_render.c */
 extern mng_handle mng_load(char *filename);
 extern void mng_done(mng_handle mngh);
 extern mng_retcode mng_render_next(mng_handle mngh);
+extern int mng_cache_frames(mng_handle mngh, long *budget);
+extern void mng_encode_frame(mng_handle mngh, int over);
 extern int mng_display_next(mng_handle mngh, unsigned char* dest, int x, int y);
 extern mng_retcode mng_render_proportional(mng_handle mngh, int progress);
 
@@ -25,8 +25,8 @@
 
 struct config_opt {
 	char *name;
-	enum { t_int, t_path, t_box, t_icon, t_rect, t_anim, t_color, t_fontpath, 
-		t_text } type;
+	enum { t_int, t_path, t_box, t_icon, t_rect, t_anim, t_sprite, t_color,
+		t_fontpath, t_text } type;
 	void *val;
 };
 
@@ -106,6 +106,10 @@ struct config_opt opts[] =
 	{	.name = "anim",
 		.type = t_anim,
 		.val = NULL		},
+
+	{	.name = "sprite",
+		.type = t_sprite,
+		.val = NULL		},
 	
 #if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || defined(CONFIG_TTF)
 	{	.name = "text_x",
@@ -429,6 +433,7 @@ void parse_icon(char *t)
 	cim->filename = filename;
 	cim->w = cim->h	= 0;
 	cim->picbuf = NULL;
+	memset(&cim->runs, 0, sizeof(cim->runs));
 	list_add(&icons, cim);
 	cic->img = cim;
 
@@ -502,16 +507,26 @@ pr_err:
 	return;
 }
 
-#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
-void parse_anim(char *t)
+#if (defined(CONFIG_MNG) || defined(CONFIG_PNG)) && !defined(TARGET_KERNEL)
+#ifdef CONFIG_MNG
+/* What is left of the room for decoded frames, see mng_cache_frames() */
+static long anim_cache_left;
+#endif
+
+/* Parses an MNG animation, or with sheet, one from a sprite sheet, which
+ * goes on with the size of a frame, how many there are and how many are
+ * shown a second. */
+void parse_anim(char *t, int sheet)
 {
 	char *p;	
 	char *filename;
 	obj *cobj = NULL;
 	anim *canim = malloc(sizeof(anim));
+	int v[4], k;
 	
 	if (!canim)
 		return;
+	memset(canim, 0, sizeof(anim));
 	
 	skip_whitespace(&t);
 	canim->flags = 0;
@@ -566,6 +581,14 @@ void parse_anim(char *t)
 		goto pa_err;
 	t = p; skip_whitespace(&t);
 
+	/* width height frames fps */
+	for (k = 0; sheet && k < 4; k++) {
+		v[k] = strtol(t,&p,0);
+		if (t == p)
+			goto pa_err;
+		t = p; skip_whitespace(&t);
+	}
+
 	/* sanity checks */
 	if (canim->x >= fb_var.xres)
 		canim->x = fb_var.xres-1;
@@ -576,15 +599,32 @@ void parse_anim(char *t)
 
 	filename = get_filepath(filename);
 
-	canim->mng = mng_load(filename);
-	if (!canim->mng) {
+	if (sheet) {
+#ifdef CONFIG_PNG
+		canim->sprite = sprite_load(filename, v[0], v[1], v[2], v[3]);
+#endif
+		free(filename);
+		if (!canim->sprite)
+			goto pa_out;
+	} else {
+#ifdef CONFIG_MNG
+		canim->mng = mng_load(filename);
+		if (!canim->mng) {
+			free(filename);
+			printk("Cannot allocate memory for mng (parse_anim)!\n");
+			goto pa_out;
+		}
+
+		if (arg_anim_cache && mng_cache_frames(canim->mng, &anim_cache_left))
+			printk("Can't cache the frames of %s, decoding them as they are shown.\n", filename);
+#else
+		printk("MNG animations are not supported, ignoring %s.\n", filename);
 		free(filename);
-		printk("Cannot allocate memory for mng (parse_anim)!\n");
 		goto pa_out;
+#endif
+		free(filename);
 	}
 
-	free(filename);
-
 	cobj = malloc(sizeof(obj));
 	if (!cobj) {
 		printk("Cannot allocate memory (parse_anim)!\n");
@@ -600,7 +640,7 @@ pa_out:
 	free(canim);
 	return;
 }
-#endif /* CONFIG_MNG */
+#endif /* CONFIG_MNG || CONFIG_PNG */
 
 void parse_box(char *t)
 {
@@ -614,6 +654,8 @@ void parse_box(char *t)
 	
 	skip_whitespace(&t);
 	cbox->attr = 0;
+	cbox->stack = NULL;
+	cbox->rows = NULL;
 
 	while (!isdigit(*t)) {
 		if (!strncmp(t,"noover",6)) {
@@ -943,6 +985,36 @@ pt_out:	free(ct);
 }
 #endif	/* TTF */
 
+/* Marks the objects that look the same whatever the progress is. The second
+ * box of an 'inter' pair is part of the progress bar, whatever its flags. */
+static void classify_objs()
+{
+	item *i;
+	obj *o;
+
+	for (i = objs.head; i != NULL; i = i->next) {
+		o = (obj*)i->p;
+		o->flags = 0;
+
+		if (o->type == o_box) {
+			if (!(((box*)o->p)->attr & BOX_INTER))
+				o->flags = F_OBJ_STATIC;
+			else if (i->next && ((obj*)i->next->p)->type == o_box) {
+				i = i->next;
+				((obj*)i->p)->flags = 0;
+			}
+		} else if (o->type == o_icon) {
+			o->flags = F_OBJ_STATIC;
+		}
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || defined(CONFIG_TTF)
+		else if (o->type == o_text) {
+			if (!(((text*)o->p)->flags & (F_TXT_EXEC | F_TXT_EVAL)))
+				o->flags = F_OBJ_STATIC;
+		}
+#endif
+	}
+}
+
 int parse_cfg(char *cfgfile)
 {
 	FILE* cfg;
@@ -954,6 +1026,10 @@ int parse_cfg(char *cfgfile)
 		fprintf(stderr, "Can't open config file %s.\n", cfgfile);
 		return 1;
 	}
+
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+	anim_cache_left = (long)arg_anim_cache << 10;
+#endif
 	
 	while (fgets(buf, sizeof(buf), cfg)) {
 
@@ -1019,9 +1095,13 @@ int parse_cfg(char *cfgfile)
 					parse_rect(t);
 					break;
 
-#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+#if (defined(CONFIG_MNG) || defined(CONFIG_PNG)) && !defined(TARGET_KERNEL)
 				case t_anim:
-					parse_anim(t);
+					parse_anim(t, 0);
+					break;
+
+				case t_sprite:
+					parse_anim(t, 1);
 					break;
 #endif
 #if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || defined(CONFIG_TTF)
@@ -1035,6 +1115,7 @@ int parse_cfg(char *cfgfile)
 	}
 
 	fclose(cfg);
+	classify_objs();
 	return 0;
 }
 
@@ -29,191 +29,155 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include "splash.h"
 
+/* The rows objects are drawn to; see set_band(). */
+__thread int band_y1 = 0, band_y2 = INT_MAX;
+
 void render_icon(icon *ticon, u8 *target)
 {
-	int y, yi;
-	int bytespp = (fb_var.bits_per_pixel + 7) >> 3;
+	int y, yi, y1 = ticon->y, y2 = ticon->y + ticon->img->h - 1;
 	u8 *out = NULL;
 	u8 *in = NULL;
+
+	if (!band_clip(&y1, &y2))
+		return;
 	
-	for (y = ticon->y, yi = 0; yi < ticon->img->h; yi++, y++) {
+	for (y = y1, yi = y1 - ticon->y; y <= y2; yi++, y++) {
 		out = target + (ticon->x + y * fb_var.xres) * bytespp;
-		in = ticon->img->picbuf + yi * ticon->img->w * 4;
-		truecolor2fb((truecolor*)in, out, ticon->img->w, y, 1);
+		if (ticon->img->runs.runs) {
+			rle_blit(out, &ticon->img->runs, yi, ticon->img->w);
+		} else {
+			in = ticon->img->picbuf + yi * ticon->img->w * 4;
+			blend_span(out, (truecolor*)in, ticon->img->w);
+		}
 	}
+
+	mark_damage(ticon->x, y1, ticon->x + ticon->img->w - 1, y2);
 }
 
-inline void put_pixel (u8 a, u8 r, u8 g, u8 b, u8 *src, u8 *dst, u8 add)
+/* Fills a span with an opaque colour; nothing needs to be read back. */
+static void fill_span(u8 *dst, u32 c, int len)
 {
-	if (fb_opt) {
-		if (a != 255) {
-			dst[fb_ro] = (src[fb_ro]*(255-a) + r*a) / 255;
-			dst[fb_go] = (src[fb_go]*(255-a) + g*a) / 255;
-			dst[fb_bo] = (src[fb_bo]*(255-a) + b*a) / 255;
-		} else {
-			dst[fb_ro] = r;
-			dst[fb_go] = g;
-			dst[fb_bo] = b;
-		}
-	} else {
-		u32 i;
-		u8 tr, tg, tb;
-
-		if (a != 255) {
-			if (fb_var.bits_per_pixel == 16) { 
-				i = *(u16*)src;
-			} else if (fb_var.bits_per_pixel == 24) {
-				i = *(u32*)src & 0xffffff;
-			} else if (fb_var.bits_per_pixel == 32) {
-				i = *(u32*)src;
-			} else {
-				i = *(u32*)src & ((2 << fb_var.bits_per_pixel)-1);
-			}
+	u32 *d = (u32*)dst;
 
-			tr = (( (i >> fb_var.red.offset & ((1 << fb_rlen)-1)) 
-			      << (8 - fb_rlen)) * (255 - a) + r * a) / 255;
-			tg = (( (i >> fb_var.green.offset & ((1 << fb_glen)-1)) 
-			      << (8 - fb_glen)) * (255 - a) + g * a) / 255;
-			tb = (( (i >> fb_var.blue.offset & ((1 << fb_blen)-1)) 
-			      << (8 - fb_blen)) * (255 - a) + b * a) / 255;
-		} else {
-			tr = r;
-			tg = g;
-			tb = b;
-		}
-		
-		/* We only need to do dithering if depth is <24bpp */
-		if (fb_var.bits_per_pixel < 24) {
-			tr = CLAMP(tr + add*2 + 1);
-			tg = CLAMP(tg + add);
-			tb = CLAMP(tb + add*2 + 1);
-		}
-	
-		tr >>= (8 - fb_rlen);
-		tg >>= (8 - fb_glen);
-		tb >>= (8 - fb_blen);
-
-		i = (tr << fb_var.red.offset) |
-		    (tg << fb_var.green.offset) |
-		    (tb << fb_var.blue.offset);
-
-		if (fb_var.bits_per_pixel == 16) {
-			*(u16*)dst = i;
-		} else if (fb_var.bits_per_pixel == 24) {
-			if (endianess == little) { 
-				*(u16*)dst = i & 0xffff;
-				dst[2] = (i >> 16) & 0xff;
-			} else {
-				*(u16*)dst = (i >> 8) & 0xffff;
-				dst[2] = i & 0xff;
-			}
-		} else if (fb_var.bits_per_pixel == 32) {
-			*(u32*)dst = i;
+	while (len-- > 0)
+		*d++ = c;
+}
+
+/* Draws rows first to last of a box with a gradient into dst, len bytes
+ * apart. The colours of the left and right edges are stepped down the box
+ * in 16.16 fixed point, and each row is then a span of its own. */
+static void render_box_rows(box *box, u8 *dst, int len, int first, int last)
+{
+	int y, k, l[4], r[4], dl[4], dr[4];
+	u8 *c = (u8*)&box->c_ul;	/* c_ul, c_ur, c_ll, c_lr; r, g, b, a */
+	gradient gr;
+
+	int b_width = box->x2 - box->x1 + 1;
+	int b_height = box->y2 - box->y1 + 1;
+	int h = (b_height > 1) ? b_height - 1 : 1;
+
+	/* The edges are rounded, so that the last row gets its colours. */
+	for (k = 0; k < 4; k++) {
+		l[k] = (c[k] << 16) + 0x8000;
+		r[k] = (c[4 + k] << 16) + 0x8000;
+		dl[k] = ((c[8 + k] - c[k]) * 65536) / h;
+		dr[k] = ((c[12 + k] - c[4 + k]) * 65536) / h;
+		l[k] += dl[k] * first;
+		r[k] += dr[k] * first;
+	}
+
+	for (y = first; y <= last; y++, dst += len) {
+		/* The colour is stepped once before the first pixel, as
+		 * it always was. */
+		gr.dr = (((r[0] >> 16) - (l[0] >> 16)) * 65536) / b_width;
+		gr.dg = (((r[1] >> 16) - (l[1] >> 16)) * 65536) / b_width;
+		gr.db = (((r[2] >> 16) - (l[2] >> 16)) * 65536) / b_width;
+		gr.da = (((r[3] >> 16) - (l[3] >> 16)) * 65536) / b_width;
+		gr.r = (l[0] & ~0xffff) + gr.dr;
+		gr.g = (l[1] & ~0xffff) + gr.dg;
+		gr.b = (l[2] & ~0xffff) + gr.db;
+		gr.a = (l[3] & ~0xffff) + gr.da;
+
+		blend_gradient(dst, b_width, &gr);
+
+		for (k = 0; k < 4; k++) {
+			l[k] += dl[k];
+			r[k] += dr[k];
 		}
 	}
 }
 
-void render_box2(box *box, u8 *target)
+static int box_solid(box *box)
 {
-	int x, y, a, r, g, b;
-	int add = 0;
-	u8 *pic;
-	u8 solid = 0;
-	
+	color *c = &box->c_ul;	/* c_ul, c_ur, c_ll, c_lr */
+
+	return !memcmp(&c[0], &c[1], sizeof(color)) &&
+	       !memcmp(&c[0], &c[2], sizeof(color)) &&
+	       !memcmp(&c[0], &c[3], sizeof(color));
+}
+
+/* Opaque gradients that never move look the same every time, so their rows
+ * are rendered once, for render_box2() to copy. */
+static void cache_box_rows(box *box)
+{
+	color *c = &box->c_ul;
 	int b_width = box->x2 - box->x1 + 1;
 	int b_height = box->y2 - box->y1 + 1;
-	
-	if (!memcmp(&box->c_ul, &box->c_ur, sizeof(color)) &&
-	    !memcmp(&box->c_ul, &box->c_ll, sizeof(color)) &&
-	    !memcmp(&box->c_ul, &box->c_lr, sizeof(color))) {
-		solid = 1;
-	}
-	
-	for (y = box->y1; y <= box->y2; y++) {
-
-		int r1, r2, g1, g2, b1, b2, a1, a2;
-		int h1, h2, h;
-		u8  opt = 0;
-		float hr = 0, hg = 0, hb = 0, ha = 0, fr = 0, fg = 0, fb = 0, fa = 0;
-
-		pic = target + (box->x1 + y * fb_var.xres) * bytespp;
-
-		/* Do a nice 2x2 ordered dithering, like it was done in bootsplash;
-		 * this makes the pics in 15/16bpp modes look much nicer;
-		 * the produced pattern is:
-		 * 303030303..
-		 * 121212121..
-		 */
-		add = (box->x1 & 1);
-		add ^= (add ^ y) & 1 ? 1 : 3;
-		
-		if (solid) {
-			r = box->c_ul.r;
-			g = box->c_ul.g;
-			b = box->c_ul.b;
-			a = box->c_ul.a;
-			opt = 1;
-		} else {
-			h1 = box->y2 - y;
-			h2 = y - box->y1;
-		
-			if (b_height > 1)
-				h = b_height -1;
-			else
-				h = 1;
-			
-			r1 = (h1 * box->c_ul.r + h2 * box->c_ll.r)/h;
-			r2 = (h1 * box->c_ur.r + h2 * box->c_lr.r)/h;
 
-			g1 = (h1 * box->c_ul.g + h2 * box->c_ll.g)/h;
-			g2 = (h1 * box->c_ur.g + h2 * box->c_lr.g)/h;
+	if (box->rows || (box->attr & BOX_INTER) || box_solid(box) ||
+	    c[0].a != 255 || c[1].a != 255 || c[2].a != 255 || c[3].a != 255 ||
+	    b_width * b_height * bytespp > MAX_BOX_CACHE)
+		return;
 
-			b1 = (h1 * box->c_ul.b + h2 * box->c_ll.b)/h;
-			b2 = (h1 * box->c_ur.b + h2 * box->c_lr.b)/h;
+	box->rows = malloc(b_width * b_height * bytespp);
+	if (box->rows)
+		render_box_rows(box, box->rows, b_width * bytespp, 0, b_height - 1);
+}
 
-			a1 = (h1 * box->c_ul.a + h2 * box->c_ll.a)/h;
-			a2 = (h1 * box->c_ur.a + h2 * box->c_lr.a)/h;
+void render_box2(box *box, u8 *target)
+{
+	int y, y1 = box->y1, y2 = box->y2;
+	u8 *pic, *row;
+	color *c = &box->c_ul;	/* c_ul, c_ur, c_ll, c_lr */
+	gradient gr;
+	
+	int b_width = box->x2 - box->x1 + 1;
+	int len = fb_var.xres * bytespp;
 
-			if (r1 == r2 && g1 == g2 && b1 == b2 && a1 == a2) { 
-				opt = 1;	
-			} else {
-				r2 -= r1;
-				g2 -= g1;
-				b2 -= b1;
-				a2 -= a1;
-
-				hr = 1.0/b_width * r2;
-				hg = 1.0/b_width * g2;
-				hb = 1.0/b_width * b2;
-				ha = 1.0/b_width * a2;
-			}
-				
-			r = r1; fr = (float)r1;
-			g = g1; fg = (float)g1;
-			b = b1; fb = (float)b1;
-			a = a1; fa = (float)a1;
-		}
-			
-		for (x = box->x1; x <= box->x2; x++) {
-			if (!opt) { 
-				fa += ha;
-				fr += hr;
-				fg += hg;
-				fa += hb;
-		
-				a = (u8)fa;
-				b = (u8)fb;
-				g = (u8)fg;
-				r = (u8)fr;
-			}
+	if (!band_clip(&y1, &y2))
+		return;
+	
+	pic = target + (box->x1 + y1 * fb_var.xres) * bytespp;
+
+	if (box_solid(box)) {
+		memset(&gr, 0, sizeof(gr));
+		gr.r = c->r << 16; gr.g = c->g << 16;
+		gr.b = c->b << 16; gr.a = c->a << 16;
 
-			put_pixel(a, r, g, b, pic, pic, add);
-			pic += bytespp;
-			add ^= 3;
+		for (y = y1; y <= y2; y++, pic += len) {
+			if (c->a == 255)
+				fill_span(pic, (c->r << 16) | (c->g << 8) | c->b, b_width);
+			else
+				blend_gradient(pic, b_width, &gr);
 		}
+		goto out;
+	}
+
+	if (box->rows) {
+		row = box->rows + (y1 - box->y1) * b_width * bytespp;
+		for (y = y1; y <= y2; y++, pic += len, row += b_width * bytespp)
+			memcpy(pic, row, b_width * bytespp);
+		goto out;
 	}
+
+	render_box_rows(box, pic, len, y1 - box->y1, y2 - box->y1);
+out:
+	mark_damage(box->x1, y1, box->x2, y2);
 }
 
 /* Interpolates two boxes, based on the value of the arg_progress variable.
@@ -245,6 +209,236 @@ void interpolate_box(box *a, box *b)
 	inter_color(a->c_lr, b->c_lr);
 }
 
+/* Display lists: the objects drawn in a given mode, in the order they are
+ * drawn, with 'inter' pairs resolved and whatever can't be drawn at all
+ * left out. Built once the theme is loaded, so that the rendering loop
+ * doesn't have to work all of this out again for every frame. */
+dlist dl_silent, dl_verbose;
+
+/* Finds the area an object can draw to. Returns 0 if it can't be drawn. */
+static int obj_area(obj *o, box *n, rect *r)
+{
+	if (o->type == o_box) {
+		box *b = (box*)o->p;
+
+		r->x1 = b->x1; r->x2 = b->x2;
+		r->y1 = b->y1; r->y2 = b->y2;
+		if (n) {
+			r->x1 = min(r->x1, n->x1); r->x2 = max(r->x2, n->x2);
+			r->y1 = min(r->y1, n->y1); r->y2 = max(r->y2, n->y2);
+		}
+	} else if (o->type == o_icon) {
+		icon *c = (icon*)o->p;
+
+		if (!c->status || !c->img || !c->img->picbuf)
+			return 0;
+
+		if (c->img->w > fb_var.xres - c->x || c->img->h > fb_var.yres - c->y) {
+			printwarn("Icon %s does not fit on the screen - ignoring it.", c->img->filename);
+			return 0;
+		}
+
+		r->x1 = c->x; r->x2 = c->x + c->img->w - 1;
+		r->y1 = c->y; r->y2 = c->y + c->img->h - 1;
+	} else if (o->type == o_anim) {
+		anim *a = (anim*)o->p;
+		int w, h;
+
+		if (a->sprite) {
+			w = a->sprite->w;
+			h = a->sprite->h;
+		} else {
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+			mng_anim *mng = mng_get_userdata(a->mng);
+
+			w = mng->canvas_w;
+			h = mng->canvas_h;
+#else
+			return 0;
+#endif
+		}
+
+		r->x1 = a->x; r->x2 = a->x + w - 1;
+		r->y1 = a->y; r->y2 = a->y + h - 1;
+	}
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
+	else if (o->type == o_text) {
+		text *ct = (text*)o->p;
+		char *p;
+		int h, lines = 1;
+
+		if (!ct->font || !ct->font->font)
+			return 0;
+
+		h = ct->font->font->height;
+		for (p = ct->val; *p; p++)
+			if (*p == '\n')
+				lines++;
+
+		/* We don't know how wide the text will be, nor what a program
+		 * will print, so play it safe. */
+		r->x1 = 0; r->x2 = fb_var.xres - 1;
+		r->y1 = ct->y - h;
+		r->y2 = (ct->flags & F_TXT_EXEC) ? fb_var.yres - 1 : ct->y + lines * h;
+	}
+#endif
+	else {
+		return 0;
+	}
+
+	/* 'inter' pairs can be empty at some point and not at another */
+	if (!n && (r->x1 > r->x2 || r->y1 > r->y2))
+		return 0;
+
+	r->x1 = max(r->x1, 0);
+	r->y1 = max(r->y1, 0);
+	r->x2 = min(r->x2, (int)fb_var.xres - 1);
+	r->y2 = min(r->y2, (int)fb_var.yres - 1);
+	return 1;
+}
+
+static int obj_in_mode(obj *o, char mode)
+{
+	u8 f = 0;
+
+	if (o->type == o_box)
+		return ((((box*)o->p)->attr & BOX_SILENT) ? 's' : 'v') == mode;
+	if (o->type == o_icon)
+		return mode == 's';
+	if (o->type == o_anim)
+		f = ((anim*)o->p)->flags;
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
+	if (o->type == o_text)
+		f = ((text*)o->p)->flags;
+#endif
+	/* F_ANIM_SILENT and F_TXT_SILENT are the same, as are the VERBOSE ones */
+	return f & (mode == 's' ? F_TXT_SILENT : F_TXT_VERBOSE);
+}
+
+static void build_dlist(dlist *dl, char mode)
+{
+	item *i;
+	obj *o;
+	box *n;
+	dl_item *d;
+	int cnt = 0;
+
+	for (i = objs.head; i != NULL; i = i->next)
+		cnt++;
+
+	dl->cnt = 0;
+	dl->items = malloc(cnt * sizeof(dl_item));
+	if (!dl->items)
+		return;
+
+	for (i = objs.head; i != NULL; i = i->next) {
+		o = (obj*)i->p;
+		n = NULL;
+
+		if (o->type == o_box && (((box*)o->p)->attr & BOX_INTER) && i->next) {
+			/* An 'inter' box that isn't followed by another box
+			 * doesn't get drawn at all. */
+			if (((obj*)i->next->p)->type != o_box)
+				continue;
+			n = (box*)((obj*)i->next->p)->p;
+			i = i->next;
+		}
+
+		d = &dl->items[dl->cnt];
+		if (!obj_in_mode(o, mode) || !obj_area(o, n, &d->r))
+			continue;
+
+		d->type = o->type;
+		d->flags = o->flags;
+		d->p = o->p;
+		d->n = n;
+		d->draw = 0;
+		d->txt = NULL;
+		dl->cnt++;
+	}
+}
+
+void build_dlists()
+{
+	free_dlists();
+	free_box_rows();
+	build_dlist(&dl_silent, 's');
+	build_dlist(&dl_verbose, 'v');
+}
+
+void free_dlists()
+{
+	free_bins();
+	free(dl_silent.items);
+	free(dl_verbose.items);
+	dl_silent.items = dl_verbose.items = NULL;
+	dl_silent.cnt = dl_verbose.cnt = 0;
+}
+
+/* Drops the rows cached for render_box2(). */
+void free_box_rows()
+{
+	item *i;
+	box *b;
+
+	for (i = objs.head; i != NULL; i = i->next) {
+		if (((obj*)i->p)->type != o_box)
+			continue;
+		b = (box*)((obj*)i->p)->p;
+		free(b->rows);
+		b->rows = NULL;
+	}
+}
+
+/* Draws an object that doesn't depend on the progress. */
+void render_fixed_obj(dl_item *d, u8 *target)
+{
+	if (d->type == o_box) {
+		render_box2((box*)d->p, target);
+	} else if (d->type == o_icon) {
+		render_icon((icon*)d->p, target);
+	}
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
+	else if (d->type == o_text) {
+		text *ct = (text*)d->p;
+		TTF_Render(target, ct->val, ct->font->font, ct->style, ct->x, ct->y,
+			   ct->col, ct->hotspot);
+	}
+#endif
+}
+
+/* Draws the static objects into the silent background once and drops them
+ * from the display list. An object can only go there if nothing that is
+ * still rendered every time lies underneath it. */
+void bake_objs(u8 *target)
+{
+	damage live;
+	dl_item *d, *end, *out;
+	int k;
+
+	damage_clear(&live);
+	end = dl_silent.items + dl_silent.cnt;
+
+	for (d = out = dl_silent.items; d < end; d++) {
+		for (k = 0; k < live.cnt; k++)
+			if (rect_overlap(&live.r[k], &d->r))
+				break;
+
+		if (!(d->flags & F_OBJ_STATIC) || k < live.cnt) {
+			damage_add(&live, d->r.x1, d->r.y1, d->r.x2, d->r.y2);
+			*out++ = *d;
+			continue;
+		}
+
+		render_fixed_obj(d, target);
+	}
+
+	dl_silent.cnt = out - dl_silent.items;
+
+	/* This is the background now */
+	damage_clear(&obj_damage);
+}
+
 char *get_program_output(char *prg, unsigned char origin)
 {
 	char *buf = malloc(1024);
@@ -363,221 +557,437 @@ void prep_bgnd(u8 *target, u8 *src, int x, int y, int w, int h)
  * render_objs() */
 void prep_bgnds(u8 *target, u8 *bgnd, char mode)
 {
-	item *i;
-	obj *o;
-	icon *c;
-	box *b, *n;
-
-	for (i = objs.head; i != NULL; i = i->next) {
-		o = (obj*)i->p;	
+	dlist *dl = (mode == 's') ? &dl_silent : &dl_verbose;
+	dl_item *d, *end = dl->items + dl->cnt;
+	box *n;
+
+	for (d = dl->items; d < end; d++) {
+		if (d->type == o_box) {
+			n = d->n;
+			if (n)
+				prep_bgnd(target, bgnd, n->x1, n->y1, n->x2 - n->x1 + 1, n->y2 - n->y1 + 1);
+		} else if (d->type == o_icon) {
+			prep_bgnd(target, bgnd, d->r.x1, d->r.y1, d->r.x2 - d->r.x1 + 1,
+				  d->r.y2 - d->r.y1 + 1);
+		}
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
+		else if (d->type == o_text) {
+			text *ct = (text*)d->p;
+			prep_bgnd(target, bgnd, ct->x, ct->y, fb_var.xres - ct->x, ct->font->font->height);
+		}
+#endif
+	}
 
-		if (o->type == o_box) {
-			b = (box*)o->p;
-				
-			if (b->attr & BOX_SILENT && mode != 's')
-				continue;
+#if (defined(CONFIG_TTF_KERNEL) && defined(TARGET_KERNEL)) || (!defined(TARGET_KERNEL) && defined(CONFIG_TTF))
+	if (mode == 's') {
+		prep_bgnd(target, bgnd, cf.text_x, cf.text_y, fb_var.xres - cf.text_x, global_font->height);
+	}
+#endif
+}
 
-			if (!(b->attr & BOX_SILENT) && mode != 'v')
-				continue;
+/* Limits drawing to rows y1 to y2. */
+void set_band(int y1, int y2)
+{
+	band_y1 = y1;
+	band_y2 = y2;
+}
 
-			if ((b->attr & BOX_INTER) && i->next != NULL) {
-				if (((obj*)i->next->p)->type == o_box) {
-					n = (box*)((obj*)i->next->p)->p;
-					prep_bgnd(target, bgnd, n->x1, n->y1, n->x2 - n->x1 + 1, n->y2 - n->y1 + 1);
-				}
-			}
-		} else if (o->type == o_icon && mode == 's') {
-			c = (icon*)o->p;
+/* The boot message for the frame being drawn, if it is drawn at all */
+static char *msg;
+static u8 msg_draw;
 
-			if (c->status == 0)
-				continue;
+/* Whether anything before d in the frame being set up draws to where d
+ * does. */
+static int covered(dl_item *first, dl_item *d)
+{
+	dl_item *e;
 
-			if (!c->img)
-				continue;
+	for (e = first; e < d; e++)
+		if (e->draw && rect_overlap(&e->r, &d->r))
+			return 1;
 
-			if (!c->img->picbuf)
-				continue;
-			
-			if (c->img->w > fb_var.xres - c->x || c->img->h > fb_var.yres - c->y) {
-				continue;				
-			}
+	return 0;
+}
 
-			prep_bgnd(target, bgnd, c->x, c->y, c->img->w, c->img->h); 
-		}	
-#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
-		else if (o->type == o_text) {
-			text *ct = (text*)o->p;
-								
-			if (mode == 's' && !(ct->flags & F_TXT_SILENT))
-				continue;
+/* Milliseconds on a clock that is never set back, for timing frames. */
+long anim_clock()
+{
+	struct timespec t;
 
-			if (mode == 'v' && !(ct->flags & F_TXT_VERBOSE))
-				continue;
-		
-			if (!ct->font || !ct->font->font)
-				continue;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
 
-			prep_bgnd(target, bgnd, ct->x, ct->y, fb_var.xres - ct->x, ct->font->font->height);
-		}
+/* Moves a looped or played once animation on to its next frame, if that is
+ * due by now. Returns 1 if it did. */
+static int step_anim(anim *a, long now)
+{
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+	mng_anim *mng;
+	mng_retcode ret;
 #endif
+
+	if (a->status == F_ANIM_STATUS_DONE)
+		return 0;
+
+	if (a->sprite) {
+		if (a->sprite->displayed_first && now < a->sprite->due)
+			return 0;
+
+		if (sprite_next(a->sprite, (a->flags & F_ANIM_METHOD_MASK) == F_ANIM_LOOP))
+			return 1;
+
+		a->status = F_ANIM_STATUS_DONE;
+		return 0;
 	}
 
-#if (defined(CONFIG_TTF_KERNEL) && defined(TARGET_KERNEL)) || (!defined(TARGET_KERNEL) && defined(CONFIG_TTF))
-	if (mode == 's') {
-		prep_bgnd(target, bgnd, cf.text_x, cf.text_y, fb_var.xres - cf.text_x, global_font->height);
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+	mng = mng_get_userdata(a->mng);
+	if (mng->displayed_first && now < mng->due)
+		return 0;
+
+	ret = mng_render_next(a->mng);
+	if (ret == MNG_NOERROR && (a->flags & F_ANIM_METHOD_MASK) == F_ANIM_LOOP) {
+		/* Over, start again */
+		mng_display_restart(a->mng);
+		ret = mng_render_next(a->mng);
 	}
+
+	/* Nothing more to wait for */
+	if (ret != MNG_NEEDTIMERWAIT)
+		a->status = F_ANIM_STATUS_DONE;
 #endif
+	return 1;
 }
 
-void render_objs(u8 *target, u8 *bgnd, char mode, unsigned char origin, int progress_only)
+/* Gets the frame of an animation ready to be drawn; see mng_encode_frame()
+ * for over. */
+static void prep_anim(anim *a, int over)
 {
-	item *i;
-	obj *o;
-	icon *c;
-	anim *a;
-	box tmp, *b, *n;
-
-	if (fb_var.bits_per_pixel == 8)
-		return;
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+	if (!a->sprite)
+		mng_encode_frame(a->mng, over);
+#endif
+}
 
-	if (bgnd)
-		prep_bgnds(target, bgnd, mode);
-	
-	for (i = objs.head; i != NULL; i = i->next) {
-		o = (obj*)i->p;	
+/* Whether the next frame of a looped or played once animation is ever due,
+ * and when. */
+static int anim_due(anim *a, long *due)
+{
+	if (a->status == F_ANIM_STATUS_DONE)
+		return 0;
 
-		if (o->type == o_box) {
-			b = (box*)o->p;
+	if (a->sprite) {
+		*due = a->sprite->due;
+		return a->sprite->displayed_first;
+	}
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+	{
+		mng_anim *mng = mng_get_userdata(a->mng);
 
-			if (progress_only && (b->attr & BOX_NOOVER))
-				continue;
+		*due = mng->due;
+		return mng->displayed_first;
+	}
+#else
+	return 0;
+#endif
+}
 
-			if (b->attr & BOX_SILENT && mode != 's')
-				continue;
+/* Sets up a frame with nothing in it but the animations of the silent
+ * image whose next frame is due by now, to be drawn like one set up by
+ * begin_objs(). Returns how many there are. *wait is set to the ms until
+ * another one is due, or -1 if none ever is. */
+int begin_anims(int *wait)
+{
+	dl_item *d, *end = dl_silent.items + dl_silent.cnt;
+	long now = anim_clock(), due;
+	anim *a;
+	int n = 0;
 
-			if (!(b->attr & BOX_SILENT) && mode != 'v')
-				continue;
-			
-			if ((b->attr & BOX_INTER) && i->next != NULL) {
-				if (((obj*)i->next->p)->type == o_box) {
-					n = (box*)((obj*)i->next->p)->p;
-					tmp = *b;
-					interpolate_box(&tmp, n);
-					render_box2(&tmp, target);
-					i = i->next;
-				}
-			} else {
-				render_box2(b, target);
-			}
-		} else if (o->type == o_icon && mode == 's') {
-			if (progress_only)
-				continue;
+	*wait = -1;
+	for (d = dl_silent.items; d < end; d++) {
+		d->draw = 0;
+		if (d->type != o_anim)
+			continue;
 
-			c = (icon*)o->p;
+		a = (anim*)d->p;
+		if ((a->flags & F_ANIM_METHOD_MASK) == F_ANIM_PROPORTIONAL)
+			continue;
 
-			if (c->status == 0)
-				continue;
+		if (step_anim(a, now)) {
+			prep_anim(a, !covered(dl_silent.items, d));
+			d->draw = 1;
+			n++;
+		}
 
-			if (!c->img)
-				continue;
+		if (anim_due(a, &due) && (*wait < 0 || due - now < *wait))
+			*wait = max(due - now, 0L);
+	}
 
-			if (!c->img->picbuf)
-				continue;
-			
-			if (c->img->w > fb_var.xres - c->x || c->img->h > fb_var.yres - c->y) {
-				printwarn("Icon %s does not fit on the screen - ignoring it.", c->img->filename);
-				continue;				
-			}
+	return n;
+}
 
-			render_icon(c, target);
-		} else if (o->type == o_anim) {
-			u8 render_it = 0;
+/* Works out what goes into the next frame. Whatever changes from one frame
+ * to the next (animations, text that is evaluated, the progress bars) is
+ * done here, once, so that draw_objs() can then be called for every band. */
+void begin_objs(char mode, unsigned char origin, int progress_only)
+{
+	dlist *dl = (mode == 's') ? &dl_silent : &dl_verbose;
+	dl_item *d, *end = dl->items + dl->cnt;
+	anim *a;
+	box *b;
 
-			a = (anim*)o->p;
+	for (d = dl->items; d < end; d++) {
+		d->draw = 1;
 
-			if (mode == 's' && !(a->flags & F_ANIM_SILENT))
-				continue;
+		if (d->type == o_box) {
+			b = (box*)d->p;
 
-			if (mode == 'v' && !(a->flags & F_ANIM_VERBOSE))
-				continue;
-			
-			if ((a->flags & F_ANIM_METHOD_MASK) == F_ANIM_ONCE) {
-				if (a->status != F_ANIM_STATUS_DONE) {
-					switch (mng_render_next(a->mng)) {
-						case MNG_NOERROR:
-							a->status = F_ANIM_STATUS_DONE;
-							break;
-						case MNG_NEEDTIMERWAIT:
-							/* FIXME: we should actually wait in this case */
-							render_it = 1;
-							break;
-					}
-				}
-			} else if ((a->flags & F_ANIM_METHOD_MASK) == F_ANIM_LOOP) {
-				if (!mng_render_next(a->mng)) {
-					/* FIXME: we should actually wait in this case */
-					mng_display_restart(a->mng);
-					mng_render_next(a->mng);
-				}
-				render_it = 1;
-			} else { /* we're F_ANIM_PROPORTIONAL */
-				if (mng_render_proportional(a->mng, arg_progress) == MNG_NEEDTIMERWAIT)
-					render_it = 1;
-			}
+			if (progress_only && (b->attr & BOX_NOOVER))
+				d->draw = 0;
+			else if (b->stack && b == b->stack->bars[0].a)
+				update_bar_stack(b->stack, progress_only);
+			else if (!b->stack && !d->n)
+				cache_box_rows(b);
+		} else if (d->type == o_icon) {
+			d->draw = !progress_only;
+		} else if (d->type == o_anim) {
+			a = (anim*)d->p;
+
+			if ((a->flags & F_ANIM_METHOD_MASK) != F_ANIM_PROPORTIONAL)
+				d->draw = step_anim(a, anim_clock()) || !progress_only;
+			else if (a->sprite)
+				d->draw = sprite_seek(a->sprite, arg_progress) || !progress_only;
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+			else
+				d->draw = (mng_render_proportional(a->mng, arg_progress) ==
+					   MNG_NEEDTIMERWAIT) || !progress_only;
+#endif
 
-			if (!progress_only || render_it)
-				mng_display_next(a->mng, target, a->x, a->y);
+			if (d->draw)
+				prep_anim(a, progress_only && !covered(dl->items, d));
 		}
 #if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
-		else if (o->type == o_text) {
+		else if (d->type == o_text) {
+			text *ct = (text*)d->p;
 
-			text *ct = (text*)o->p;
-			char *txt;
-					
-			if (progress_only && !(ct->flags & F_TXT_EVAL))
-				continue;
-
-			if (mode == 's' && !(ct->flags & F_TXT_SILENT))
-				continue;
-
-			if (mode == 'v' && !(ct->flags & F_TXT_VERBOSE))
-				continue;
-		
-			if (!ct->font || !ct->font->font)
+			if (progress_only && !(ct->flags & F_TXT_EVAL)) {
+				d->draw = 0;
 				continue;
+			}
 
 			if (ct->flags & F_TXT_EXEC) {
-				txt = get_program_output(ct->val, origin);
+				d->txt = get_program_output(ct->val, origin);
 			} else if (ct->flags & F_TXT_EVAL) {
-				txt = eval_text(ct->val);
+				d->txt = eval_text(ct->val);
 			} else {
-				txt = ct->val;
-			}
-			
-			if (txt) {
-				TTF_Render(target, txt, ct->font->font, ct->style, ct->x, ct->y, ct->col, ct->hotspot);
-				if ((ct->flags & F_TXT_EXEC) || (ct->flags & F_TXT_EVAL))
-					free(txt);
+				d->txt = ct->val;
 			}
+			d->draw = (d->txt != NULL);
 		}
 #endif
 	}
 
 #if (defined(CONFIG_TTF_KERNEL) && defined(TARGET_KERNEL)) || (!defined(TARGET_KERNEL) && defined(CONFIG_TTF))
-	if (mode == 's' && !progress_only) {
-		if (!boot_message)
-			TTF_Render(target, DEFAULT_MESSAGE, global_font,
-					TTF_STYLE_NORMAL, cf.text_x, cf.text_y,
-					cf.text_color, F_HS_LEFT | F_HS_TOP);
-		else {
-			char *t;
-			t = eval_text(boot_message);
-			TTF_Render(target, t, global_font, TTF_STYLE_NORMAL,
-					cf.text_x, cf.text_y, cf.text_color,
-					F_HS_LEFT | F_HS_TOP);
-			free(t);
+	msg_draw = (mode == 's' && !progress_only && global_font);
+	if (msg_draw && boot_message)
+		msg = eval_text(boot_message);
+#endif
+}
+
+/* Text is drawn one thread at a time, as the fonts cache glyphs. */
+static pthread_mutex_t text_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void draw_obj(dl_item *d, u8 *target)
+{
+	box tmp, *b;
+
+	/* A stack is drawn with its first bar, and clips itself. */
+	if (d->type == o_box && ((box*)d->p)->stack) {
+		b = (box*)d->p;
+		if (b == b->stack->bars[0].a)
+			render_bar_stack(b->stack, target);
+		return;
+	}
+
+	if (d->r.y1 > band_y2 || d->r.y2 < band_y1)
+		return;
+
+	if (d->type == o_box) {
+		if (d->n) {
+			tmp = *(box*)d->p;
+			interpolate_box(&tmp, d->n);
+			render_box2(&tmp, target);
+		} else {
+			render_box2((box*)d->p, target);
 		}
+	} else if (d->type == o_icon) {
+		render_icon((icon*)d->p, target);
+	} else if (d->type == o_anim) {
+		anim *a = (anim*)d->p;
+
+		if (a->sprite)
+			sprite_draw(a->sprite, target, a->x, a->y);
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+		else
+			mng_display_next(a->mng, target, a->x, a->y);
+#endif
+	}
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
+	else if (d->type == o_text) {
+		text *ct = (text*)d->p;
+		pthread_mutex_lock(&text_lock);
+		TTF_Render(target, d->txt, ct->font->font, ct->style, ct->x, ct->y, ct->col, ct->hotspot);
+		pthread_mutex_unlock(&text_lock);
+	}
+#endif
+}
+
+static void draw_msg(u8 *target)
+{
+#if (defined(CONFIG_TTF_KERNEL) && defined(TARGET_KERNEL)) || (!defined(TARGET_KERNEL) && defined(CONFIG_TTF))
+	if (msg_draw && cf.text_y <= band_y2 && cf.text_y + global_font->height > band_y1) {
+		pthread_mutex_lock(&text_lock);
+		TTF_Render(target, msg ? msg : DEFAULT_MESSAGE, global_font,
+				TTF_STYLE_NORMAL, cf.text_x, cf.text_y,
+				cf.text_color, F_HS_LEFT | F_HS_TOP);
+		pthread_mutex_unlock(&text_lock);
+	}
+#endif
+}
+
+/* Draws the part of the frame set up by begin_objs() that lies in the
+ * current band. */
+void draw_objs(u8 *target, char mode)
+{
+	dlist *dl = (mode == 's') ? &dl_silent : &dl_verbose;
+	dl_item *d, *end = dl->items + dl->cnt;
+
+	for (d = dl->items; d < end; d++)
+		if (d->draw)
+			draw_obj(d, target);
+
+	draw_msg(target);
+}
+
+/* The silent display list, binned by bands of bin_rows rows: for band k,
+ * the objects that can draw to it are bin_items[bin_start[k]] up to
+ * bin_items[bin_start[k + 1]], in the order they are drawn. */
+static dl_item **bin_items;
+static int *bin_start;
+static int bin_rows, bin_cnt;
+
+static int obj_in_band(dl_item *d, int k)
+{
+	box *b = (box*)d->p;
+	rect *r = (d->type == o_box && b->stack) ? &b->stack->r : &d->r;
+
+	if (d->type == o_box && b->stack && b != b->stack->bars[0].a)
+		return 0;
+
+	return r->y1 < (k + 1) * bin_rows && r->y2 >= k * bin_rows;
+}
+
+/* Bins the silent display list for drawing it in bands of the given
+ * height with draw_band(). Has to be done again whenever the list
+ * changes. */
+void bin_objs(int rows)
+{
+	dl_item *d, *end = dl_silent.items + dl_silent.cnt;
+	int k, n = 0;
+
+	free_bins();
+
+	bin_rows = rows;
+	bin_cnt = (fb_var.yres + rows - 1) / rows;
+
+	for (k = 0; k < bin_cnt; k++)
+		for (d = dl_silent.items; d < end; d++)
+			n += obj_in_band(d, k);
+
+	bin_start = malloc((bin_cnt + 1) * sizeof(int));
+	bin_items = malloc(max(n, 1) * sizeof(dl_item*));
+	if (!bin_start || !bin_items) {
+		free_bins();
+		return;
+	}
+
+	for (k = 0, n = 0; k < bin_cnt; k++) {
+		bin_start[k] = n;
+		for (d = dl_silent.items; d < end; d++)
+			if (obj_in_band(d, k))
+				bin_items[n++] = d;
+	}
+	bin_start[k] = n;
+}
+
+void free_bins()
+{
+	free(bin_items);
+	free(bin_start);
+	bin_items = NULL;
+	bin_start = NULL;
+	bin_cnt = 0;
+}
+
+/* Swaps the bins with those kept for another screen. */
+void swap_bins(bin_set *s)
+{
+	bin_set t = { bin_items, bin_start, bin_rows, bin_cnt };
+
+	bin_items = s->items;
+	bin_start = s->start;
+	bin_rows = s->rows;
+	bin_cnt = s->cnt;
+	*s = t;
+}
+
+/* Draws band k of the silent image, as set up by begin_objs(). The band
+ * has to be the one set with set_band(). */
+void draw_band(u8 *target, int k)
+{
+	dl_item **d, **end;
+
+	if (!bin_items) {
+		draw_objs(target, 's');
+		return;
 	}
+
+	end = bin_items + bin_start[k + 1];
+	for (d = bin_items + bin_start[k]; d < end; d++)
+		if ((*d)->draw)
+			draw_obj(*d, target);
+
+	draw_msg(target);
+}
+
+/* Drops whatever begin_objs() set up. */
+void end_objs(char mode)
+{
+	dlist *dl = (mode == 's') ? &dl_silent : &dl_verbose;
+	dl_item *d, *end = dl->items + dl->cnt;
+
+	for (d = dl->items; d < end; d++) {
+#if (defined(CONFIG_TTY_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL))
+		if (d->type == o_text && d->txt != ((text*)d->p)->val)
+			free(d->txt);
 #endif
+		d->txt = NULL;
+		d->draw = 0;
+	}
+
+	free(msg);
+	msg = NULL;
+	msg_draw = 0;
 }
 
+void render_objs(u8 *target, u8 *bgnd, char mode, unsigned char origin, int progress_only)
+{
+	begin_objs(mode, origin, progress_only);
+
+	if (bgnd)
+		prep_bgnds(target, bgnd, mode);
+
+	draw_objs(target, mode);
+	end_objs(mode);
+}
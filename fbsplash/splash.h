@@ -6,10 +6,6 @@
 #include <linux/fb.h>
 #include <linux/types.h>
 
-#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
-	#include "mng_splash.h"
-#endif
-
 #if !defined(CONFIG_FBSPLASH)
 	#define FB_SPLASH_IO_ORIG_USER 	 0
 	#define FB_SPLASH_IO_ORIG_KERNEL 1
@@ -19,6 +15,9 @@
 #define MAX_RECTS 	32
 #define MAX_BOXES 	256
 #define MAX_ICONS 	512
+#define MAX_DAMAGE	32
+#define MAX_BAR_STACK	8
+#define MAX_BOX_CACHE	(4 << 20)	/* bytes of pre-rendered rows per box */
 #define PATH_DEV	"/dev"
 #define PATH_PROC	"/proc"
 #define PATH_SYS	"/sys"
@@ -75,10 +74,32 @@ enum ESVC { e_display, e_svc_inact_start, e_svc_inact_stop, e_svc_start,
  * 				Structures 
  * ************************************************************************ */
 
+/* An image with alpha as runs of transparent, opaque and translucent
+ * pixels, see rle_encode() */
+#define RUN_SKIP	0
+#define RUN_SOLID	1
+#define RUN_BLEND	2
+#define RUN_CLEAR	3	/* turned transparent, in deltas */
+#define RUN_LEN		0x3fff	/* type << 14 | length */
+
+typedef struct {
+	u16 *runs;		/* for every row, the number of runs and the runs */
+	u8 *data;		/* pixels of the opaque and translucent runs */
+	u32 *row;		/* where every row starts in runs and data */
+	int w, h, depth;
+} rle;
+
+/* A premultiplied pixel: the colour multiplied by alpha, and 255 - alpha,
+ * in the order of the channels of the internal format */
+typedef struct {
+	u16 b, g, r, ia;
+} pm_pixel;
+
 typedef struct {
 	char *filename;
 	u32 w, h;
 	u8 *picbuf;
+	rle runs;
 } icon_img;
 
 typedef struct {
@@ -92,8 +113,11 @@ typedef struct {
 typedef struct obj {
 	enum { o_box, o_icon, o_text, o_anim } type;
 	void *p;
+	u8 flags;
 } obj;
 
+#define F_OBJ_STATIC	1	/* looks the same every time it's drawn */
+
 typedef struct color {
 	u8 r, g, b, a;
 } __attribute__ ((packed)) color;
@@ -106,7 +130,31 @@ typedef struct {
 	int x1, x2, y1, y2;
 } rect;
 
+typedef struct {
+	rect r[MAX_DAMAGE];
+	int cnt;
+} damage;
+
+/* What a part of the image drawn by a worker thread has touched, until it
+ * is added to the global lists */
+typedef struct {
+	damage fb, obj, bars;
+} damage_set;
+
+#define DMG_FB		0x01	/* fb_damage */
+#define DMG_OBJ		0x02	/* obj_damage */
+#define DMG_BARS	0x04	/* the bars drawn over */
+
+static inline int rect_overlap(rect *a, rect *b)
+{
+	return a->x1 <= b->x2 && b->x1 <= a->x2 &&
+	       a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
 #if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
+#include "mng_splash.h"
+#endif
+
 #define F_ANIM_SILENT		1
 #define F_ANIM_VERBOSE		2
 
@@ -117,15 +165,28 @@ typedef struct {
 
 #define F_ANIM_STATUS_DONE 1
 
+/* The frames of a sprite sheet, see sprite.c */
+typedef struct {
+	rle *frames;
+	int w, h, cnt;
+	int delay;		/* ms per frame */
+	int cur;		/* the frame to draw next */
+	int displayed_first;
+	long due;		/* when the next frame is, by anim_clock() */
+} sprite;
+
+/* An MNG animation, or one from a sprite sheet if sprite is set */
 typedef struct {
 	int x, y;
+#if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
 	mng_handle mng;
+#endif
+	sprite *sprite;
 	char *svc;
 	enum ESVC type;
 	u8 status;
 	u8 flags;
 } anim;
-#endif	/* CONFIG_MNG */
 
 #define F_TXT_SILENT  	1
 #define F_TXT_VERBOSE	2
@@ -167,6 +228,8 @@ typedef struct {
 	struct color c_ul, c_ur, c_ll, c_lr; 	/* upper left, upper right, 
 						   lower left, lower right */
 	u8 attr;
+	struct bar_stack *stack;		/* set if drawn from strips */
+	u8 *rows;				/* pre-rendered, see render_box2() */
 } box;
 
 typedef struct truecolor {
@@ -177,6 +240,60 @@ typedef struct truecolor {
 #define BOX_INTER 0x02
 #define BOX_SILENT 0x04
 
+/* An 'inter' box pair that is drawn from pre-rendered strips */
+typedef struct {
+	box *a, *b;
+	rect r;			/* area covered at any progress */
+	u8 *full;		/* r, with the bar drawn over all of it */
+	int x1, x2;		/* columns currently covered */
+} bar;
+
+/* Overlapping bars, with what is underneath them */
+typedef struct bar_stack {
+	rect r;
+	u8 *empty;		/* r, with none of the bars drawn */
+	bar bars[MAX_BAR_STACK];
+	int cnt;
+	u8 valid;		/* the silent image has the bars as in x1/x2 */
+	damage dirty;		/* drawn over since the bars were painted */
+	damage todo;		/* to be painted in the frame being drawn */
+} bar_stack;
+
+/* An object as drawn in a particular mode */
+typedef struct {
+	u8 type;		/* o_box, o_icon, ... */
+	u8 flags;		/* F_OBJ_* */
+	void *p;
+	box *n;			/* second box of an 'inter' pair */
+	rect r;			/* area it can draw to */
+	u8 draw;		/* worked out once for the frame being drawn: */
+	char *txt;		/* whether to draw it, and the text to draw */
+} dl_item;
+
+typedef struct {
+	dl_item *items;
+	int cnt;
+} dlist;
+
+/* What bars.c and the bins of render.c hold for a screen while another one
+ * is drawn, see swap_bars() and swap_bins() */
+typedef struct {
+	list stacks;
+	int slow;
+} bar_set;
+
+typedef struct {
+	dl_item **items;
+	int *start;
+	int rows, cnt;
+} bin_set;
+
+/* A colour that changes along a span, in 16.16 fixed point */
+typedef struct {
+	int r, g, b, a;
+	int dr, dg, db, da;	/* added for every pixel */
+} gradient;
+
 struct splash_config {
 	u8 bg_color;
 	u16 tx;
@@ -196,12 +313,16 @@ struct splash_config {
 /* common.c */
 void detect_endianess(void);
 int get_fb_settings(int fb_num);
+void init_fb_format();
+int pan_fb(int fd, int n);
+void reset_fb_pages(int fd);
 char *get_cfg_file(char *theme);
 int do_getpic(unsigned char, unsigned char, char);
 int do_config(unsigned char);
 char *get_filepath(char *path);
 void vt_cursor_enable(int fd);
 void vt_cursor_disable(int fd);
+int open_fb_num(int n);
 int open_fb();
 int open_tty(int);
 int tty_unset_silent(int fd);
@@ -229,11 +350,71 @@ int remove_dev(char *fn, int flag);
 
 /* render.c */
 void render_objs(u8 *target, u8 *bgnd, char mode, unsigned char origin, int progress_only);
-inline void put_pixel (u8 a, u8 r, u8 g, u8 b, u8 *src, u8 *dst, u8 add);
+void begin_objs(char mode, unsigned char origin, int progress_only);
+int begin_anims(int *wait);
+long anim_clock();
+void draw_objs(u8 *target, char mode);
+void end_objs(char mode);
+void set_band(int y1, int y2);
+void bin_objs(int rows);
+void free_bins();
+void swap_bins(bin_set *s);
+void draw_band(u8 *target, int k);
+void prep_bgnd(u8 *target, u8 *src, int x, int y, int w, int h);
+void render_box2(box *box, u8 *target);
+void render_icon(icon *ticon, u8 *target);
+void interpolate_box(box *a, box *b);
+void build_dlists();
+void free_dlists();
+void free_box_rows();
+void render_fixed_obj(dl_item *d, u8 *target);
+void bake_objs(u8 *target);
+
+/* sprite.c */
+sprite *sprite_load(char *filename, int w, int h, int cnt, int fps);
+void sprite_free(sprite *s);
+int sprite_next(sprite *s, int loop);
+int sprite_seek(sprite *s, int progress);
+void sprite_draw(sprite *s, u8 *target, int x, int y);
+
+/* bars.c */
+void prep_bars(u8 *target, u8 *bgnd);
+void free_bars();
+void swap_bars(bar_set *s);
+int bars_can_shrink();
+void update_bar_stack(bar_stack *s, int progress_only);
+void render_bar_stack(bar_stack *s, u8 *target);
+void bars_damage(int x1, int y1, int x2, int y2);
 
 /* image.c */
 int load_images(char mode);
-void truecolor2fb (truecolor* data, u8* out, int len, int y, u8 alpha);
+int load_png(char *filename, u8 **data, struct fb_cmap *cmap, u32 *width, u32 *height, u8 want_alpha);
+void truecolor2fb (truecolor* data, u8* out, int len, u8 alpha);
+
+/* blend.c */
+void init_blend();
+void pm_convert(pm_pixel *dst, truecolor *src, int len);
+int rle_encode(rle *r, u8 *src, int w, int h, int pitch, int depth);
+int rle_encode_delta(rle *r, u8 *src, u8 *prev, int w, int h, int pitch);
+void rle_apply(u8 *dst, rle *r, int pitch);
+void rle_free(rle *r);
+void rle_blit(u8 *dst, rle *r, int y, int len);
+void rle_blit_mask(u8 *dst, rle *r, int y, int len, color c);
+
+/* convert.c */
+typedef void (*convert_fn)(u8 *dst, u8 *src, int len, int x, int y);
+void convert_copy(u8 *dst, u8 *src, int len, int x, int y);
+int fb_in_ram(struct fb_fix_screeninfo *fix);
+void init_converter();
+void init_palette_lut(struct fb_cmap *cmap);
+void present_row(u8 *dst, u8 *src, int len, int x, int y);
+void rotate_rect(rect *r);
+void present_rotated(u8 *fb, u8 *src, int w, int h, int x, int y);
+int init_scaler(int w, int h);
+void free_scaler();
+void present_scaled(u8 *fb, u8 *img, rect *r);
+void present_flush();
+void present_report();
 
 /* cmd.c */
 void cmd_setstate(unsigned int state, unsigned char origin);
@@ -249,9 +430,32 @@ void do_repaint(u8 *dst, u8 *src);
 /* list.c */
 void list_add(list *l, void *obj);
 
+/* kms.c */
+int kms_open(int n);
+int kms_owns_fb(int n);
+u8 *kms_buffer();
+void kms_wait();
+int kms_present(damage *d);
+void kms_close();
+
+/* workers.c */
+int start_workers(int n);
+void stop_workers();
+void run_jobs(void (*fn)(int k), int n);
+
+/* damage.c */
+void damage_clear(damage *d);
+void damage_all(damage *d);
+void damage_add(damage *d, int x1, int y1, int x2, int y2);
+void damage_diff(damage *d, u8 *a, u8 *b);
+void add_damage(int what, int x1, int y1, int x2, int y2);
+void mark_damage(int x1, int y1, int x2, int y2);
+void merge_damage(damage_set *s);
+void restore_areas(u8 *target, u8 *src, damage *d);
+void restore_damage(u8 *target, u8 *src);
+
 /* effects.c */
-void put_img(u8 *dst, u8 *src);
-void fade_in(u8 *dst, u8 *image, struct fb_cmap cmap, u8 bgnd, int fd);
+void fade_areas(u8 *dst, u8 *from, u8 *to, damage *d, u8 a);
 void set_directcolor_cmap(int fd);
 
 extern char *cf_pic;
@@ -266,6 +470,8 @@ extern enum ENDIANESS endianess;
 extern enum TASK arg_task;
 extern int arg_fb;
 extern int arg_vc;
+extern int arg_rotate;
+extern int arg_anim_cache;
 extern char *arg_theme;
 extern char arg_mode;
 extern u16 arg_progress;
@@ -283,6 +489,9 @@ extern list objs;
 extern list rects;
 extern list fonts;
 
+extern dlist dl_silent, dl_verbose;
+extern __thread int band_y1, band_y2;
+
 extern u8 *bg_buffer;
 extern int bytespp;
 
@@ -292,13 +501,54 @@ extern struct fb_image silent_img;
 extern struct splash_config cf;
 
 /* common.c */
-extern u8 fb_opt;
-extern u8 fb_ro, fb_go, fb_bo;
+extern int fb_bytespp;
 extern u8 fb_rlen, fb_glen, fb_blen;
+extern int fb_pages;
+extern int fb_rotate;
+extern int fb_width, fb_height;
 
 extern int fb_fd, fbsplash_fd;
+
+/* blend.c */
+extern void (*blend_span)(u8 *dst, truecolor *src, int len);
+extern void (*blend_pm)(u8 *dst, pm_pixel *src, int len);
+extern void (*blend_mask)(u8 *dst, u8 *mask, int len, color c);
+extern void (*blend_gradient)(u8 *dst, int len, gradient *g);
+extern void (*blend_fade)(u8 *dst, u8 *from, u8 *to, int len, u8 a);
+
+/* convert.c */
+extern convert_fn fb_convert;
+
+/* damage.c */
+extern damage fb_damage;
+extern damage obj_damage;
+extern __thread damage_set *local_damage;
 extern char *progress_text;
 
+/* Clips the rows y1 to y2 to the band being drawn. Returns 0 if none of
+ * them are in it. */
+static inline int band_clip(int *y1, int *y2)
+{
+	*y1 = max(*y1, band_y1);
+	*y2 = min(*y2, band_y2);
+	return *y1 <= *y2;
+}
+
+/* Blends a colour into a pixel of the internal format (0x00RRGGBB). */
+static inline void put_pixel(u8 a, u8 r, u8 g, u8 b, u8 *src, u8 *dst)
+{
+	u32 s;
+
+	if (a != 255) {
+		s = *(u32*)src;
+		r = (((s >> 16) & 0xff) * (255 - a) + r * a) / 255;
+		g = (((s >> 8) & 0xff) * (255 - a) + g * a) / 255;
+		b = ((s & 0xff) * (255 - a) + b * a) / 255;
+	}
+
+	*(u32*)dst = (r << 16) | (g << 8) | b;
+}
+
 /* Added for use in dynamically loaded functions */
 //void (*png_sig_cmp)(png_bytep sig, png_size_t start, png_size_t num_to_check);
 #endif /* __SPLASH_H__ */
@@ -0,0 +1,129 @@
+/*
+ * sprite.c - Animations from the frames of a PNG sprite sheet
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+/* The frames of a sheet lie left to right, then top to bottom, all of the
+ * same size. They are cut out and coded as runs when the theme is loaded,
+ * so that showing one is as cheap as drawing an icon, and are shown at a
+ * fixed rate. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../userui.h"
+#include "splash.h"
+
+#ifdef CONFIG_PNG
+sprite *sprite_load(char *filename, int w, int h, int cnt, int fps)
+{
+	sprite *s;
+	u8 *sheet = NULL;
+	u32 sw = 0, sh = 0;
+	int k, cols;
+
+	if (w <= 0 || h <= 0 || cnt <= 0 || fps <= 0)
+		return NULL;
+
+	if (load_png(filename, &sheet, NULL, &sw, &sh, 1)) {
+		printk("Failed to load sprite sheet %s.\n", filename);
+		return NULL;
+	}
+
+	cols = sw / w;
+	if (!cols || cnt > cols * (sh / h)) {
+		printk("Sprite sheet %s doesn't hold %d frames of %dx%d.\n",
+				filename, cnt, w, h);
+		goto fail;
+	}
+
+	if (!(s = calloc(1, sizeof(sprite))) ||
+	    !(s->frames = calloc(cnt, sizeof(rle)))) {
+		printk("Cannot allocate memory for sprite %s!\n", filename);
+		free(s);
+		goto fail;
+	}
+
+	s->w = w;
+	s->h = h;
+	s->cnt = cnt;
+	s->delay = max(1000 / fps, 1);
+
+	for (k = 0; k < cnt; k++) {
+		if (rle_encode(&s->frames[k], sheet + ((k / cols) * h * sw + (k % cols) * w) * 4,
+			       w, h, sw * 4, 4)) {
+			printk("Cannot allocate memory for sprite %s!\n", filename);
+			sprite_free(s);
+			goto fail;
+		}
+	}
+
+	free(sheet);
+	return s;
+
+fail:
+	free(sheet);
+	return NULL;
+}
+#endif
+
+void sprite_free(sprite *s)
+{
+	int k;
+
+	for (k = 0; k < s->cnt; k++)
+		rle_free(&s->frames[k]);
+	free(s->frames);
+	free(s);
+}
+
+/* Moves a looped or played once sprite on to its next frame. Returns 1 if
+ * it did, or 0 if it is over. */
+int sprite_next(sprite *s, int loop)
+{
+	if (!s->displayed_first)
+		s->cur = 0;
+	else if (s->cur + 1 < s->cnt)
+		s->cur++;
+	else if (loop && s->cnt > 1)
+		s->cur = 0;
+	else
+		return 0;
+
+	s->displayed_first = 1;
+	s->due = anim_clock() + s->delay;
+	return 1;
+}
+
+/* Goes to the frame for the progress. Returns 1 if that is another one. */
+int sprite_seek(sprite *s, int progress)
+{
+	int k = min(progress * s->cnt / PROGRESS_MAX, s->cnt - 1);
+
+	if (s->displayed_first && k == s->cur)
+		return 0;
+
+	s->displayed_first = 1;
+	s->cur = k;
+	return 1;
+}
+
+void sprite_draw(sprite *s, u8 *target, int x, int y)
+{
+	int w = min(s->w, (int)fb_var.xres - x);
+	int l, y1 = y, y2 = min(y + s->h, (int)fb_var.yres) - 1;
+	u8 *out;
+
+	if (!band_clip(&y1, &y2))
+		return;
+
+	out = target + (x + y1 * fb_var.xres) * bytespp;
+	for (l = y1; l <= y2; l++, out += fb_var.xres * bytespp)
+		rle_blit(out, &s->frames[s->cur], l - y, w);
+
+	mark_damage(x, y1, x + w - 1, y2);
+}
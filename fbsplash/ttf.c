@@ -38,25 +38,195 @@ char *boot_message = NULL;
 #define DEFAULT_PTSIZE  18
 #define NUM_GRAYS       256
 
-void TTF_RenderUNICODE_Shaded(u8 *target, const unsigned short *text,
+/* Text up to this long is converted on the stack */
+#define TEXT_MAX	256
+
+/* What an average glyph takes in the glyph cache, for sizing its pool */
+#define GLYPH_BYTES	1024
+#define GLYPH_ENTRIES	64	/* at the least */
+
+void TTF_RenderUNICODE_Shaded(u8 *target, const u32 *text,
 	 		      TTF_Font* font, int x, int y, color fcol, u8 hotspot);
 
 
 static void Flush_Glyph(c_glyph* glyph);
 
-static void Flush_Cache(TTF_Font* font)
+/* The glyphs past Latin-1, of every font and style, are kept in a hash table
+ * of entries from a pool allocated up front. When the pool runs out or the
+ * glyphs take more than the budget, those drawn least recently go. */
+typedef struct glyph_entry {
+	c_glyph glyph;
+	TTF_Font *font;
+	u32 ch;
+	int style;
+	int bytes;
+	struct glyph_entry *hnext;		/* in its hash chain, or free */
+	struct glyph_entry *newer, *older;	/* in LRU order */
+} glyph_entry;
+
+static glyph_entry *glyph_pool, *free_entries, *newest, *oldest;
+static glyph_entry **buckets;
+static int nbuckets;
+static long glyph_bytes, glyph_budget;
+
+static unsigned int glyph_hash(TTF_Font *font, u32 ch, int style)
 {
-	int i;  
-	int size = sizeof(font->cache) / sizeof(font->cache[0]);
-	
-	for(i = 0; i < size; ++i) {
-		if(font->cache[i].cached) {
-			Flush_Glyph(&font->cache[i]);
+	unsigned long h = ((unsigned long)font >> 4) * 31 + ch * GLYPH_STYLES + style;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h & (nbuckets - 1);
+}
+
+static void lru_unlink(glyph_entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		oldest = e->newer;
+}
+
+static void lru_push(glyph_entry *e)
+{
+	e->newer = NULL;
+	e->older = newest;
+	if (newest)
+		newest->newer = e;
+	else
+		oldest = e;
+	newest = e;
+}
+
+static void drop_entry(glyph_entry *e)
+{
+	glyph_entry **p = &buckets[glyph_hash(e->font, e->ch, e->style)];
+
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+	lru_unlink(e);
+
+	glyph_bytes -= e->bytes;
+	Flush_Glyph(&e->glyph);
+	e->font = NULL;
+	e->hnext = free_entries;
+	free_entries = e;
+}
+
+/* What the buffers of a glyph take */
+static int glyph_size(c_glyph *g)
+{
+	int size = g->bitmap.pitch * g->bitmap.rows + g->pixmap.pitch * g->pixmap.rows;
+
+	if (g->mask.runs)
+		size += (g->mask.w + 1) * g->mask.h * sizeof(u16) +
+			g->mask.w * g->mask.h + 2 * g->mask.h * sizeof(u32);
+	return size;
+}
+
+/* Allocates the pool of the glyph cache, for glyphs taking up to budget
+ * bytes. This has to be done before our memory is locked. */
+int TTF_InitCache(int budget)
+{
+	int k, n = max(budget / GLYPH_BYTES, GLYPH_ENTRIES);
+
+	for (nbuckets = 1; nbuckets < n; nbuckets <<= 1);
+
+	glyph_pool = calloc(n, sizeof(glyph_entry));
+	buckets = calloc(nbuckets, sizeof(glyph_entry*));
+	if (!glyph_pool || !buckets) {
+		free(glyph_pool);
+		free(buckets);
+		glyph_pool = NULL;
+		buckets = NULL;
+		return -1;
+	}
+
+	for (k = 0; k < n; k++) {
+		glyph_pool[k].hnext = free_entries;
+		free_entries = &glyph_pool[k];
+	}
+	glyph_budget = budget;
+	return 0;
+}
+
+/* Finds the entry for ch in the style of the font, or takes one for it. */
+static c_glyph *Hash_Glyph(TTF_Font *font, u32 ch)
+{
+	int style = GLYPH_STYLE(font->style);
+	unsigned int h;
+	glyph_entry *e;
+
+	if (!glyph_pool)
+		return NULL;
+
+	h = glyph_hash(font, ch, style);
+	for (e = buckets[h]; e; e = e->hnext) {
+		if (e->font == font && e->ch == ch && e->style == style) {
+			if (e != newest) {
+				lru_unlink(e);
+				lru_push(e);
+			}
+			return &e->glyph;
 		}
-	
 	}
-	if(font->scratch.cached) {
-		Flush_Glyph(&font->scratch);
+
+	if (!free_entries)
+		drop_entry(oldest);
+
+	e = free_entries;
+	free_entries = e->hnext;
+	e->font = font;
+	e->ch = ch;
+	e->style = style;
+	e->bytes = 0;
+	e->hnext = buckets[h];
+	buckets[h] = e;
+	lru_push(e);
+	return &e->glyph;
+}
+
+/* Counts what a glyph from Hash_Glyph() took loading, making room for it. */
+static void Hash_Loaded(c_glyph *g)
+{
+	glyph_entry *e = (glyph_entry *)g;	/* it comes first */
+
+	glyph_bytes -= e->bytes;
+	e->bytes = glyph_size(g);
+	glyph_bytes += e->bytes;
+
+	while (glyph_bytes > glyph_budget && oldest != e)
+		drop_entry(oldest);
+}
+
+static void Flush_Cache(TTF_Font* font)
+{
+	int i, s;
+	glyph_set *g;
+	glyph_entry *e, *next;
+
+	for (e = oldest; e; e = next) {
+		next = e->newer;
+		if (e->font == font)
+			drop_entry(e);
+	}
+
+	for (s = 0; s < GLYPH_STYLES; s++) {
+		if (!(g = font->glyphs[s]))
+			continue;
+
+		for(i = 0; i < 256; ++i) {
+			if(g->cache[i].cached) {
+				Flush_Glyph(&g->cache[i]);
+			}
+		}
+		free(g);
+		font->glyphs[s] = NULL;
 	}
 }       
 
@@ -90,28 +260,22 @@ int ceil(float a)
 }
 #endif
 
-static unsigned short *UTF8_to_UNICODE(unsigned short *unicode, const char *utf8, int len)
+/* A sequence cut short by the end of the text is taken byte by byte. */
+static u32 *UTF8_to_UTF32(u32 *unicode, const char *utf8, int len)
 {
-	int i, j;
-	unsigned short ch;
+	const unsigned char *s = (const unsigned char *)utf8;
+	int i, j, n;
+	u32 ch;
 				
 	for (i=0, j=0; i < len; ++i, ++j) {
-		ch = ((const unsigned char *)utf8)[i];
-		if (ch >= 0xF0) {
-			ch  =  (unsigned short)(utf8[i]&0x07) << 18;
-			ch |=  (unsigned short)(utf8[++i]&0x3F) << 12;
-			ch |=  (unsigned short)(utf8[++i]&0x3F) << 6;
-			ch |=  (unsigned short)(utf8[++i]&0x3F);
-		} else
-		if (ch >= 0xE0) {
-			ch  =  (unsigned short)(utf8[i]&0x3F) << 12;
-			ch |=  (unsigned short)(utf8[++i]&0x3F) << 6;
-			ch |=  (unsigned short)(utf8[++i]&0x3F);
-		} else
-		if (ch >= 0xC0) {
-			ch  =  (unsigned short)(utf8[i]&0x3F) << 6;
-			ch |=  (unsigned short)(utf8[++i]&0x3F);
-		}
+		ch = s[i];
+		n = (ch >= 0xF0) ? 3 : (ch >= 0xE0) ? 2 : (ch >= 0xC0) ? 1 : 0;
+		if (i + n >= len)
+			n = 0;
+		if (n)
+			ch &= 0x3F >> n;
+		for (; n > 0; n--)
+			ch = (ch << 6) | (s[++i] & 0x3F);
 		unicode[j] = ch;
 	}
 	unicode[j] = 0;
@@ -119,6 +283,19 @@ static unsigned short *UTF8_to_UNICODE(unsigned short *unicode, const char *utf8
 	return unicode;
 }
 
+/* Converts text to buf if it fits, or else to a buffer it allocates. */
+static u32 *text_to_UTF32(u32 *buf, const char *text)
+{
+	int len = strlen(text);
+	u32 *unicode = buf;
+
+	if (len > TEXT_MAX && !(unicode = malloc((len + 1) * sizeof(u32)))) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	return UTF8_to_UTF32(unicode, text, len);
+}
+
 /* TTF stuff */
 
 static FT_Library library;
@@ -146,24 +323,21 @@ void TTF_Quit(void)
 		FT_Done_FreeType(library);
 	}
 	TTF_initialized = 0;
+
+	free(glyph_pool);
+	free(buckets);
+	glyph_pool = free_entries = newest = oldest = NULL;
+	buckets = NULL;
+	glyph_bytes = 0;
 }
 
 unsigned char*TTF_RenderText_Shaded(u8 *target, const char *text, TTF_Font *font, int x, int y, color col, u8 hotspot)
 {
-	unsigned short *p, *t, *unicode_text;
-	int unicode_len;
+	u32 buf[TEXT_MAX + 1], *p, *t, *unicode_text;
 
-	/* Copy the Latin-1 text to a UNICODE text buffer */
-	unicode_len = strlen(text);
-	unicode_text = (unsigned short *)malloc((unicode_len+1)*(sizeof*unicode_text));
-	
-	if (unicode_text == NULL) {
-		printf("Out of memory\n");
-		return(NULL);
-	}	       
-
-	UTF8_to_UNICODE(unicode_text, text, unicode_len);
-//	ASCII_to_UNICODE(unicode_text, text, unicode_len);
+	/* Copy the UTF-8 text to a UTF-32 text buffer */
+	if (!(unicode_text = text_to_UTF32(buf, text)))
+		return NULL;
 
 	for (t = p = unicode_text; *p != 0; p++) {
 		if (*p == '\n') {
@@ -180,7 +354,8 @@ unsigned char*TTF_RenderText_Shaded(u8 *target, const char *text, TTF_Font *font
 	}
     
 	/* Free the text buffer and return */
-	free(unicode_text);
+	if (unicode_text != buf)
+		free(unicode_text);
 	return NULL;
 }
 
@@ -191,10 +366,10 @@ void TTF_CloseFont(TTF_Font* font)
 	free(font);
 }			     
 
+/* Glyphs are cached for each style, so this costs nothing. */
 void TTF_SetFontStyle(TTF_Font* font, int style)
 {
 	font->style = style;
-	Flush_Cache(font);
 }
     
 TTF_Font* TTF_OpenFontIndex(const char *file, int ptsize, long index)
@@ -304,10 +479,11 @@ static void Flush_Glyph(c_glyph* glyph)
 		free(glyph->pixmap.buffer);
 		glyph->pixmap.buffer = 0;
 	}
+	rle_free(&glyph->mask);
 	glyph->cached = 0;
 }
 
-static FT_Error Load_Glyph(TTF_Font* font, unsigned short ch, c_glyph* cached, int want)
+static FT_Error Load_Glyph(TTF_Font* font, u32 ch, c_glyph* cached, int want)
 {
 	FT_Face face;
 	FT_Error error;
@@ -473,6 +649,10 @@ static FT_Error Load_Glyph(TTF_Font* font, unsigned short ch, c_glyph* cached, i
 			cached->stored |= CACHED_BITMAP;
 		} else {
 			cached->stored |= CACHED_PIXMAP;
+
+			/* Most of a glyph is either empty or fully covered. */
+			rle_encode(&cached->mask, dst->buffer, dst->width,
+				   dst->rows, dst->pitch, 1);
 		}
 	}
 	
@@ -482,28 +662,35 @@ static FT_Error Load_Glyph(TTF_Font* font, unsigned short ch, c_glyph* cached, i
 	return 0;
 }
 
-static FT_Error Find_Glyph(TTF_Font* font, unsigned short ch, int want)
+static FT_Error Find_Glyph(TTF_Font* font, u32 ch, int want)
 {
 	int retval = 0;
+	glyph_set *g = font->glyphs[GLYPH_STYLE(font->style)];
+
+	if (!g) {
+		g = calloc(1, sizeof(glyph_set));
+		if (!g)
+			return FT_Err_Out_Of_Memory;
+		font->glyphs[GLYPH_STYLE(font->style)] = g;
+	}
 
 	if(ch < 256) {
-		font->current = &font->cache[ch];
-	} else {
-		if (font->scratch.cached != ch) {
-			Flush_Glyph(&font->scratch);
-		}
-		font->current = &font->scratch;
+		font->current = &g->cache[ch];
+	} else if (!(font->current = Hash_Glyph(font, ch))) {
+		return FT_Err_Out_Of_Memory;
 	}
 	if ((font->current->stored & want) != want) {
 		retval = Load_Glyph(font, ch, font->current, want);
+		if (ch >= 256)
+			Hash_Loaded(font->current);
 	}
 	return retval;
 }
 
-int TTF_SizeUNICODE(TTF_Font *font, const unsigned short *text, int *w, int *h)
+int TTF_SizeUNICODE(TTF_Font *font, const u32 *text, int *w, int *h)
 {
 	int status;
-	const unsigned short *ch;
+	const u32 *ch;
 	int x, z;
 	int minx, maxx;
 	int miny, maxy;
@@ -563,15 +750,16 @@ int TTF_SizeUNICODE(TTF_Font *font, const unsigned short *text, int *w, int *h)
 }
 
 
-void TTF_RenderUNICODE_Shaded(u8 *target, const unsigned short *text,
+void TTF_RenderUNICODE_Shaded(u8 *target, const u32 *text,
  			      TTF_Font* font, int x, int y, color fcol, u8 hotspot)
 {
-	int xstart, width, height, i, j, row_underline;
-	unsigned int val;
-	const unsigned short* ch;
+	int xstart, width, height, i, j, n, row_underline;
+	const u32* ch;
 	unsigned char* src;
 	unsigned char* dst;
-	int row, col;
+	int row, cstart, cend;
+	gradient gr;
+	int dx1 = fb_var.xres, dy1 = fb_var.yres, dx2 = -1, dy2 = -1;
 	c_glyph *glyph;
 	FT_Error error;
 
@@ -604,6 +792,7 @@ void TTF_RenderUNICODE_Shaded(u8 *target, const unsigned short *text,
 	 * character. Thus all the (font->style & TTF_STYLE_UNDERLINE) ? .. : ..
 	 * code. 
 	 */
+	memset(&gr, 0, sizeof(gr));
 	row_underline = font->ascent - font->underline_offset - 1;
 	if (row_underline >= height) {
 		row_underline = (height-1) - font->underline_height;
@@ -620,15 +809,17 @@ void TTF_RenderUNICODE_Shaded(u8 *target, const unsigned short *text,
 		glyph = font->current;
 
 		current = &glyph->pixmap;
-		for(row = 0; row < ((font->style & TTF_STYLE_UNDERLINE) ? height-glyph->yoffset : current->rows); ++row) {
-			int add;
-			u8 *memlimit = target + fb_var.xres * fb_var.yres * bytespp;
+		cstart = (font->style & TTF_STYLE_UNDERLINE && glyph->minx > 0) ? -glyph->minx : 0;
+		cend = (font->style & TTF_STYLE_UNDERLINE && *(ch+1)) ?
+			current->width + glyph->advance : current->width;
 
+		for(row = 0; row < ((font->style & TTF_STYLE_UNDERLINE) ? height-glyph->yoffset : current->rows); ++row) {
 			/* Sanity checks.. */
 			i = y + row + glyph->yoffset;
 			j = xstart + glyph->minx + x;			
 			
-			if (i < 0 || i >= fb_var.yres || j >= fb_var.xres)
+			if (i < 0 || i >= fb_var.yres || j >= fb_var.xres ||
+			    i < band_y1 || i > band_y2)
 				continue;
 					
 			if (j < 0)
@@ -641,34 +832,34 @@ void TTF_RenderUNICODE_Shaded(u8 *target, const unsigned short *text,
 			dst = (unsigned char *)target + (i * fb_var.xres + j)*bytespp;
 			src = current->buffer + row*current->pitch;
 
-			add = x & 1;
-			add ^= (add ^ (row+y)) & 1 ? 1 : 3;
-		
-			for (col= ((font->style & TTF_STYLE_UNDERLINE && glyph->minx > 0) ? -glyph->minx : 0); 
-			     col < ((font->style & TTF_STYLE_UNDERLINE && *(ch+1)) ? 
-			           current->width + glyph->advance : current->width); col++) {
-			
-				if (col + j >= fb_var.xres-1)
-					continue;
-				
-				if (dst+bytespp-1 > memlimit)
-					break;
-				
-				if (row < current->rows && col < current->width && col >= 0)
-					val=*src++;
-				else
-					val=0;
-
-				/* Handle underline */
-				if (font->style & TTF_STYLE_UNDERLINE && row+glyph->yoffset >= row_underline && 
-				    row+glyph->yoffset < row_underline + font->underline_height) {
-					val = NUM_GRAYS-1;
-				}
-				
-				put_pixel(fcol.a*val/255, fcol.r, fcol.g, fcol.b, dst, dst, add);
-				dst += bytespp;
-				add ^= 3;
+			dx1 = min(dx1, j);
+			dx2 = max(dx2, j + cend - cstart - 1);
+			dy1 = min(dy1, i);
+			dy2 = max(dy2, i);
+
+			/* columns that fit on the screen */
+			n = min(cend, (int)fb_var.xres - 1 - j) - cstart;
+			if (n <= 0)
+				continue;
+
+			/* Handle underline */
+			if (font->style & TTF_STYLE_UNDERLINE && row+glyph->yoffset >= row_underline && 
+			    row+glyph->yoffset < row_underline + font->underline_height) {
+				gr.r = fcol.r << 16; gr.g = fcol.g << 16;
+				gr.b = fcol.b << 16; gr.a = fcol.a << 16;
+				blend_gradient(dst, n, &gr);
+				continue;
 			}
+
+			/* Only the glyph itself has any coverage. */
+			if (row >= current->rows)
+				continue;
+			if (glyph->mask.runs)
+				rle_blit_mask(dst - cstart * bytespp, &glyph->mask, row,
+					      min(n + cstart, current->width), fcol);
+			else
+				blend_mask(dst - cstart * bytespp, src, 
+					   min(n + cstart, current->width), fcol);
 		}
 		
 next_glyph:	xstart += glyph->advance;
@@ -676,22 +867,26 @@ next_glyph:	xstart += glyph->advance;
 			xstart += font->glyph_overhang;
 		}
 	}
+
+	if (dx2 >= dx1)
+		mark_damage(dx1, dy1, dx2, dy2);
 	return;
 }
 
 int TTF_PrimeCache(char *text, TTF_Font *font, int style) {
-	char *p;
+	u32 buf[TEXT_MAX + 1], *p, *unicode_text;
 
-	if (!text || !font)
+	if (!text || !font || !(unicode_text = text_to_UTF32(buf, text)))
 		return -1;
 
 	TTF_SetFontStyle(font, style);
-	Flush_Cache(font);
 
-	for (p = text; *p; ++p) {
+	for (p = unicode_text; *p; ++p) {
 		Find_Glyph(font, *p, CACHED_METRICS|CACHED_PIXMAP);
 	}
 	
+	if (unicode_text != buf)
+		free(unicode_text);
 	return 0;
 }
 
@@ -17,21 +17,34 @@
 #define FT_FLOOR(X)     ((X & -64) / 64)
 #define FT_CEIL(X)      (((X + 63) & -64) / 64)
 
+/* Bold and italic change the glyphs, underlining doesn't */
+#define GLYPH_STYLES		4
+#define GLYPH_STYLE(s)		((s) & (TTF_STYLE_BOLD | TTF_STYLE_ITALIC))
+
 /* Cached glyph information */
 typedef struct cached_glyph {
 	int stored;
 	FT_UInt index;
 	FT_Bitmap bitmap;
 	FT_Bitmap pixmap;
+	rle mask;		/* pixmap as runs */
 	int minx;
 	int maxx;
 	int miny;
 	int maxy;
 	int yoffset;
 	int advance;
-	unsigned short cached;
+	u32 cached;
 } c_glyph;
 
+/* The Latin-1 glyphs of a font in one style. The others are in the glyph
+ * cache, see Hash_Glyph(). */
+typedef struct {
+	c_glyph cache[256];
+} glyph_set;
+
+#define GLYPH_CACHE		256	/* kB, the default */
+
 struct _TTF_Font {
 	/* Freetype2 maintains all sorts of useful info itself */
 	FT_Face face;
@@ -53,10 +66,10 @@ struct _TTF_Font {
 	int underline_offset;
 	int underline_height;
 
-	/* Cache for style-transformed glyphs */
+	/* Cache for style-transformed Latin-1 glyphs, kept for every style
+	 * until the font is closed */
 	c_glyph *current;
-	c_glyph cache[256];
-	c_glyph scratch;
+	glyph_set *glyphs[GLYPH_STYLES];
 };
 
 typedef struct _TTF_Font TTF_Font;
@@ -67,6 +80,7 @@ extern TTF_Font *global_font;
 extern char *boot_message;
 
 int TTF_Init(void);
+int TTF_InitCache(int budget);
 void TTF_Quit(void);
 void TTF_CloseFont(TTF_Font* font);
 TTF_Font* TTF_OpenFont(const char *file, int ptsize);
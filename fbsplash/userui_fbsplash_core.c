@@ -16,10 +16,13 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/fb.h>
 #include <linux/kd.h>
@@ -34,10 +37,156 @@ static char rendermessage[512];
 static int lastloglevel;
 static unsigned long cur_value, cur_maximum, last_pos;
 static void *base_image;
-static char *frame_buffer;
+static char *frame_buffer;	/* where frames are presented to */
+static char *fb_map;
+static u8 *present_buf;
 static int base_image_size;
+static int arg_direct, direct;
+static int band_rows, bands;
+static int arg_threads = 4;
+static int arg_glyph_cache = GLYPH_CACHE;	/* kB */
+
+/* Full redraws are drawn by worker threads, chunks of bands at a time. */
+static int chunks;
+static damage_set *chunk_damage;
+static damage restore;		/* what draw_screen() restores, if it does */
+static int restoring;
+static int flipping;		/* frames are presented off-screen, then shown */
+static int flips;		/* how many frames were flipped to */
+static int page, pan_pending;	/* the fb screen presented to */
+static damage stale;		/* what the back buffer missed last frame */
+static int scaled;		/* the mode changed, see follow_mode() */
+static u8 *present_img;		/* presented instead of the silent image */
+
+/* Fades, see fade() */
+static int arg_fade = 300;	/* ms */
+static u8 *fade_buf;		/* the frame being shown */
+static u8 *fade_from, *fade_to;
+static damage fade_damage;
+static u8 fade_a;
+static int hidden;		/* draw_screen() only draws */
+static int shrunk;		/* the progress went down, see draw_screen() */
+
+/* Animations are moved on by a thread of their own, see animate(). Whatever
+ * draws or presents holds draw_lock. */
+#define ANIM_STACK	(256 << 10)
+static pthread_mutex_t draw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t anim_wake;
+static pthread_t anim_thread;
+static int animating;
+#ifdef CONFIG_KMS
+static int arg_kms, kms;
+#endif
 static struct termios termios;
 
+/* Other framebuffers in the same mode, which are shown the same image */
+#define MAX_FBS		8
+#define MAX_MIRRORS	(MAX_FBS - 1)
+
+typedef struct {
+	int cnt;
+	struct {
+		int fd;
+		char *map;
+		unsigned long smem_start;
+	} fb[MAX_MIRRORS];
+} mirror_set;
+
+static mirror_set mirrors;
+
+/* Framebuffers in other modes are shown a silent image of their own, drawn
+ * from the theme's config for their resolution, once for each mode. Drawing
+ * goes by the globals, so what another screen needs is kept here and
+ * swapped in while it is drawn, see swap_screen(). Such screens are only
+ * presented to through their mirrors, and aren't faded. */
+#define MAX_SCREENS	3
+
+typedef struct {
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	int fb_bytespp, fb_pages, fb_rotate, fb_width, fb_height;
+	u8 fb_rlen, fb_glen, fb_blen;
+	int fb_fd;
+	char *fb_map, *frame_buffer;
+	u8 *present_buf;
+	int direct, flipping, flips, page, pan_pending, scaled;
+	damage stale;
+#ifdef CONFIG_KMS
+	int kms;
+#endif
+	char *config_file;
+	struct splash_config cf;
+	char *cf_silentpic, *cf_pic, *cf_silentpic256, *cf_pic256;
+	list fonts, icons, objs, rects;
+	TTF_Font *global_font;
+	struct fb_image silent_img;
+	void *base_image;
+	int base_image_size;
+	dlist dl_silent, dl_verbose;
+	bar_set bars;
+	bin_set bins;
+	damage fb_damage, obj_damage;
+	int band_rows, bands;
+	mirror_set mirrors;
+} screen;
+
+static screen screens[MAX_SCREENS];
+static int nscreens;
+
+#define SWAP(a, b)	do { typeof(a) t = (a); (a) = (b); (b) = t; } while (0)
+
+/* Swaps the state of the screen being drawn with the one kept in s. */
+static void swap_screen(screen *s) {
+	SWAP(fb_var, s->var);
+	SWAP(fb_fix, s->fix);
+	SWAP(fb_bytespp, s->fb_bytespp);
+	SWAP(fb_pages, s->fb_pages);
+	SWAP(fb_rotate, s->fb_rotate);
+	SWAP(fb_width, s->fb_width);
+	SWAP(fb_height, s->fb_height);
+	SWAP(fb_rlen, s->fb_rlen);
+	SWAP(fb_glen, s->fb_glen);
+	SWAP(fb_blen, s->fb_blen);
+	SWAP(fb_fd, s->fb_fd);
+	SWAP(fb_map, s->fb_map);
+	SWAP(frame_buffer, s->frame_buffer);
+	SWAP(present_buf, s->present_buf);
+	SWAP(direct, s->direct);
+	SWAP(flipping, s->flipping);
+	SWAP(flips, s->flips);
+	SWAP(page, s->page);
+	SWAP(pan_pending, s->pan_pending);
+	SWAP(scaled, s->scaled);
+	SWAP(stale, s->stale);
+#ifdef CONFIG_KMS
+	SWAP(kms, s->kms);
+#endif
+	SWAP(config_file, s->config_file);
+	SWAP(cf, s->cf);
+	SWAP(cf_silentpic, s->cf_silentpic);
+	SWAP(cf_pic, s->cf_pic);
+	SWAP(cf_silentpic256, s->cf_silentpic256);
+	SWAP(cf_pic256, s->cf_pic256);
+	SWAP(fonts, s->fonts);
+	SWAP(icons, s->icons);
+	SWAP(objs, s->objs);
+	SWAP(rects, s->rects);
+	SWAP(global_font, s->global_font);
+	SWAP(silent_img, s->silent_img);
+	SWAP(base_image, s->base_image);
+	SWAP(base_image_size, s->base_image_size);
+	SWAP(dl_silent, s->dl_silent);
+	SWAP(dl_verbose, s->dl_verbose);
+	SWAP(fb_damage, s->fb_damage);
+	SWAP(obj_damage, s->obj_damage);
+	SWAP(band_rows, s->band_rows);
+	SWAP(bands, s->bands);
+	SWAP(mirrors, s->mirrors);
+	swap_bars(&s->bars);
+	swap_bins(&s->bins);
+	init_converter();
+}
+
 static void fbsplash_log_level_change();
 
 static inline void clear_display() { write(1, "\033c", 2); }
@@ -51,15 +200,6 @@ static void show_cursor() {
 	write(1, "\033[?25h\033[?0c", 11);
 }
 
-static void reset_silent_img() {
-	if (!base_image || !silent_img.data)
-		return;
-	memcpy((void*)silent_img.data, base_image, base_image_size);
-	strncpy(rendermessage, lastheader, 512);
-	render_objs((u8*)silent_img.data, NULL, 's', FB_SPLASH_IO_ORIG_USER, 0);
-	rendermessage[0] = '\0';
-}
-
 static void silent_off() {
 	/* Do we really need this? 
 	if (frame_buffer)
@@ -89,6 +229,270 @@ out:
 	return vt;
 }
 
+static int same_mode(struct fb_var_screeninfo *v, struct fb_fix_screeninfo *f) {
+	return v->xres == fb_width && v->yres == fb_height &&
+	       v->bits_per_pixel == fb_var.bits_per_pixel &&
+	       !memcmp(&v->red, &fb_var.red, sizeof(v->red)) &&
+	       !memcmp(&v->green, &fb_var.green, sizeof(v->green)) &&
+	       !memcmp(&v->blue, &fb_var.blue, sizeof(v->blue)) &&
+	       f->line_length == fb_fix.line_length &&
+	       f->visual == fb_fix.visual;
+}
+
+/* Presents what is drawn for the screen to framebuffer n, open as fd, too.
+ * It has to be in the screen's mode. */
+static int add_mirror(int n, int fd, struct fb_var_screeninfo *var,
+		      struct fb_fix_screeninfo *fix) {
+	char *map;
+
+	if (mirrors.cnt == MAX_MIRRORS)
+		return -1;
+
+	/* The workers present to it too, so it has to be mapped */
+	map = mmap(NULL, fix->line_length * var->yres,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		printk("Not using " PATH_DEV "/fb%d, it can't be mapped.\n", n);
+		return -1;
+	}
+
+	if (var->yoffset) {
+		var->yoffset = 0;
+		ioctl(fd, FBIOPAN_DISPLAY, var);
+	}
+
+	if (fix->visual == FB_VISUAL_DIRECTCOLOR)
+		set_directcolor_cmap(fd);
+	else if (silent_img.cmap.red)
+		ioctl(fd, FBIOPUTCMAP, &silent_img.cmap);
+
+	mirrors.fb[mirrors.cnt].fd = fd;
+	mirrors.fb[mirrors.cnt].map = map;
+	mirrors.fb[mirrors.cnt].smem_start = fix->smem_start;
+	mirrors.cnt++;
+	printk("Showing the %dx%d image on " PATH_DEV "/fb%d.\n", fb_width, fb_height, n);
+	return 0;
+}
+
+static void close_mirror(int i) {
+	munmap(mirrors.fb[i].map, fb_fix.line_length * fb_height);
+	close(mirrors.fb[i].fd);
+	mirrors.fb[i] = mirrors.fb[--mirrors.cnt];
+}
+
+static void close_mirrors() {
+	while (mirrors.cnt)
+		close_mirror(0);
+}
+
+/* Lets go of the mirrors that aren't in the screen's mode any more, after
+ * the atomic restore. */
+static void check_mirrors() {
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	int i = 0, fd;
+
+	while (i < mirrors.cnt) {
+		fd = mirrors.fb[i].fd;
+		if (ioctl(fd, FBIOGET_VSCREENINFO, &var) == -1 ||
+		    ioctl(fd, FBIOGET_FSCREENINFO, &fix) == -1 ||
+		    !same_mode(&var, &fix) ||
+		    fix.smem_start != mirrors.fb[i].smem_start)
+			close_mirror(i);
+		else
+			i++;
+	}
+}
+
+/* For converting lines before they are written out, or turning and
+ * scaling whole areas, when the framebuffer isn't mapped. */
+static int alloc_present_buf() {
+	if (fb_rotate || scaled)
+		present_buf = malloc(fb_fix.line_length * fb_height);
+	else
+		present_buf = malloc(fb_var.xres * fb_bytespp);
+
+	return present_buf ? 0 : -1;
+}
+
+/* Prime the font caches with glyphs in every font and style text is drawn
+ * in, and with those of the theme's own text, so we don't need to allocate
+ * them later */
+static void prime_fonts() {
+	char glyphs[96];
+	item *i;
+	text *t;
+	int k;
+
+	for (k = 0; k < 95; k++)
+		glyphs[k] = ' ' + k;
+	glyphs[k] = '\0';
+
+	TTF_PrimeCache(glyphs, global_font, TTF_STYLE_NORMAL);
+
+	for (i = objs.head; i != NULL; i = i->next) {
+		if (((obj*)i->p)->type != o_text)
+			continue;
+		t = (text*)((obj*)i->p)->p;
+		if (t->font) {
+			TTF_PrimeCache(glyphs, t->font->font, t->style);
+			TTF_PrimeCache(t->val, t->font->font, t->style);
+		}
+	}
+}
+
+/* Keeps the silent picture as the background of the screen, with whatever
+ * never changes composited into it, and renders the progress bars. */
+static int prep_silent() {
+	/* copy the silent pic to base_image for safe keeping */
+	base_image_size = silent_img.width * silent_img.height * (silent_img.depth >> 3);
+	base_image = malloc(base_image_size);
+	if (!base_image) {
+		printk("Couldn't get enough memory for framebuffer image.\n");
+		return 1;
+	}
+	memcpy(base_image, (void*)silent_img.data, base_image_size);
+
+	/* Composite whatever never changes into it */
+	bake_objs(base_image);
+	memcpy((void*)silent_img.data, base_image, base_image_size);
+
+	/* Render the progress bars at 0% and 100% */
+	prep_bars((u8*)silent_img.data, base_image);
+	return 0;
+}
+
+/* Splits the screen into bands small enough to stay in the cache while they
+ * are restored, drawn to and presented. */
+static void init_bands() {
+	long cache = 256 << 10;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	if (sysconf(_SC_LEVEL2_CACHE_SIZE) > 0)
+		cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+	band_rows = max(8, cache / 2 / (long)(fb_var.xres * (2 * bytespp + fb_bytespp)));
+	bands = (fb_var.yres + band_rows - 1) / band_rows;
+	bin_objs(band_rows);
+}
+
+/* Frees what another screen, swapped in, was set up with. */
+static void free_screen() {
+	close_mirrors();
+	free((void*)silent_img.data);
+	free(base_image);
+	free(config_file);
+	free_bars();
+	free_dlists();
+	free_box_rows();
+	free_fonts();
+}
+
+/* Sets up a screen for framebuffer n, open as fd, in a mode other than
+ * ours. */
+static int load_screen(screen *s, int n, int fd, struct fb_var_screeninfo *var,
+		       struct fb_fix_screeninfo *fix) {
+	int err = 1;
+
+	memset(s, 0, sizeof(*s));
+	s->fb_fd = -1;
+	s->fb_pages = 1;
+	swap_screen(s);
+
+	fb_var = *var;
+	fb_fix = *fix;
+	init_fb_format();
+
+	config_file = get_cfg_file(arg_theme);
+	if (!config_file || parse_cfg(config_file))
+		goto out;
+	printk("Using configuration file %s for " PATH_DEV "/fb%d.\n", config_file, n);
+	if (do_getpic(FB_SPLASH_IO_ORIG_USER, 0, 's') == -1)
+		goto out;
+
+	prime_fonts();
+	build_dlists();
+	if (prep_silent() || add_mirror(n, fd, var, fix))
+		goto out;
+
+	init_bands();
+	err = 0;
+out:
+	if (err)
+		free_screen();
+	swap_screen(s);
+	return err;
+}
+
+/* Finds the other framebuffers. Those in our mode are shown whatever is
+ * presented to ours, a band at a time; the others are drawn to once for
+ * each mode they are in. */
+static void open_screens() {
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	int n, k, fd, found;
+
+	for (n = 0; n < MAX_FBS; n++) {
+		if (n == arg_fb && fb_fd != -1)
+			continue;
+#ifdef CONFIG_KMS
+		/* What we show on the DRM device would only be copied to a
+		 * framebuffer that isn't scanned out */
+		if (kms && (n == arg_fb || kms_owns_fb(n)))
+			continue;
+#endif
+		if ((fd = open_fb_num(n)) == -1)
+			continue;
+
+		if (ioctl(fd, FBIOGET_VSCREENINFO, &var) == -1 ||
+		    ioctl(fd, FBIOGET_FSCREENINFO, &fix) == -1) {
+			close(fd);
+			continue;
+		}
+
+		if (same_mode(&var, &fix)) {
+			if (add_mirror(n, fd, &var, &fix))
+				close(fd);
+			continue;
+		}
+
+		for (k = 0, found = 0; k < nscreens && !found; k++) {
+			swap_screen(&screens[k]);
+			if ((found = same_mode(&var, &fix)) && add_mirror(n, fd, &var, &fix))
+				close(fd);
+			swap_screen(&screens[k]);
+		}
+		if (found)
+			continue;
+
+		/* Colours only map to indices through the palette of an 8bpp
+		 * image, which would have to be ours */
+		if (n == arg_fb || nscreens == MAX_SCREENS || var.bits_per_pixel == 8 ||
+		    load_screen(&screens[nscreens], n, fd, &var, &fix)) {
+			printk("Not using " PATH_DEV "/fb%d, its mode can't be shown.\n", n);
+			close(fd);
+			continue;
+		}
+		nscreens++;
+	}
+}
+
+static void close_screens() {
+	int k;
+
+	for (k = 0; k < nscreens; k++) {
+		swap_screen(&screens[k]);
+		free_screen();
+		swap_screen(&screens[k]);
+	}
+	nscreens = 0;
+}
+
+static void fbsplash_preload() {
+	if (TTF_InitCache(arg_glyph_cache << 10))
+		printk("Couldn't allocate the glyph cache.\n");
+}
+
 static int fbsplash_load() {
 	fb_fd = -1;
 	last_pos = 0;
@@ -99,10 +503,20 @@ static int fbsplash_load() {
 	}
 
 	/* Find out the FB size */
+#ifdef CONFIG_KMS
+	if (arg_kms || get_fb_settings(0)) {
+		if (kms_open(0)) {
+			printk("Couldn't get fb settings.\n");
+			return 1;
+		}
+		kms = 1;
+	}
+#else
 	if (get_fb_settings(0)) {
 		printk("Couldn't get fb settings.\n");
 		return 1;
 	}
+#endif
 
 	arg_vc = get_active_vt();
 	arg_mode = 's';
@@ -119,11 +533,11 @@ static int fbsplash_load() {
 
 	parse_cfg(config_file);
 
-	/* Prime the font cache with glyphs so we don't need to allocate them later */
-	TTF_PrimeCache("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 -.", global_font, TTF_STYLE_NORMAL);
-
 	boot_message = rendermessage;
 
+#ifdef CONFIG_KMS
+	if (!kms) {
+#endif
 	fb_fd = open_fb();
 	if (fb_fd == -1) {
 		printk("Couldn't open framebuffer device.\n");
@@ -132,6 +546,9 @@ static int fbsplash_load() {
 
 	if (fb_fix.visual == FB_VISUAL_DIRECTCOLOR)
 		set_directcolor_cmap(fb_fd);
+#ifdef CONFIG_KMS
+	}
+#endif
 
 	fbsplash_fd = open(SPLASH_DEV, O_WRONLY); /* Don't worry if it fails */
 
@@ -139,46 +556,105 @@ static int fbsplash_load() {
 	if (do_getpic(FB_SPLASH_IO_ORIG_USER, 0, 's') == -1)
 		no_silent_image = 1; /* We do care if this fails. */
 
+	prime_fonts();
+
+	build_dlists();
+
 	/* These next two touch the kernel and are needed even for silent mode, to
 	 * get the colours right (even on 32-bit depth displays funnily enough. */
 	do_config(FB_SPLASH_IO_ORIG_USER);
 	cmd_setstate(1, FB_SPLASH_IO_ORIG_USER);
 
-	/* copy the silent pic to base_image for safe keeping */
-	if (!no_silent_image) {
-		base_image_size = silent_img.width * silent_img.height * (silent_img.depth >> 3);
-		base_image = malloc(base_image_size);
-		if (!base_image) {
+	if (!no_silent_image && prep_silent())
+		return 1;
+
+#ifdef CONFIG_KMS
+	if (kms) {
+		/* Frames go to whichever buffer isn't being shown */
+		frame_buffer = (char*)kms_buffer();
+		flipping = 1;
+	} else
+#endif
+	if ((fb_map = mmap(NULL, fb_fix.line_length * fb_height * fb_pages,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0)) == MAP_FAILED) {
+		fb_map = NULL;
+
+		if (alloc_present_buf()) {
 			printk("Couldn't get enough memory for framebuffer image.\n");
 			return 1;
 		}
-		memcpy(base_image, (void*)silent_img.data, base_image_size);
+	} else if (fb_pages > 1 && !arg_direct && !pan_fb(fb_fd, 0)) {
+		/* Frames go to the screen below the visible one */
+		page = 1;
+		frame_buffer = fb_map + fb_fix.line_length * fb_height;
+		flipping = 1;
+	} else if ((frame_buffer = fb_map) && !no_silent_image &&
+		   fb_var.bits_per_pixel == 32 && !fb_rotate &&
+		   fb_convert == convert_copy &&
+		   fb_fix.line_length == fb_var.xres * bytespp &&
+		   (arg_direct || fb_in_ram(&fb_fix))) {
+		/* The framebuffer is laid out just like our image and lives in
+		 * ordinary memory, so draw straight into it.
+		 * base_image still has the background for what we draw over. */
+		free((void*)silent_img.data);
+		silent_img.data = frame_buffer;
+		direct = 1;
 	}
 
-	frame_buffer = mmap(NULL, fb_fix.line_length * fb_var.yres,
-			PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
-	if (frame_buffer == MAP_FAILED)
-		frame_buffer = NULL;
+	if (!no_silent_image) {
+		open_screens();
+
+		/* Fades can't be shown while drawing straight to the screen */
+		if (arg_fade && !direct)
+			fade_buf = malloc(base_image_size);
+	}
+
+	init_bands();
 
 	printk("Framebuffer support initialised successfully.\n");
 	return 0;
 }
 
+static void stop_animating() {
+	if (!animating)
+		return;
+
+	pthread_mutex_lock(&draw_lock);
+	animating = 0;
+	pthread_cond_signal(&anim_wake);
+	pthread_mutex_unlock(&draw_lock);
+
+	pthread_join(anim_thread, NULL);
+	pthread_cond_destroy(&anim_wake);
+}
+
+static void stop_threads() {
+	stop_animating();
+	stop_workers();
+	free(chunk_damage);
+	chunk_damage = NULL;
+	chunks = 0;
+}
+
 static void fbsplash_unprepare() {
+	stop_threads();
 	clear_display();
 	show_cursor();
 }
 
 static void fbsplash_cleanup()
 {
+	stop_threads();
 	clear_display();
 	cmd_setstate(0, FB_SPLASH_IO_ORIG_USER);
 
 	ioctl(STDOUT_FILENO, TCSETSF, (long)&termios);
 	show_cursor();
 
-	free((void*)silent_img.data);
+	if (!direct)
+		free((void*)silent_img.data);
 	silent_img.data = NULL;
+	direct = 0;
 
 	free(silent_img.cmap.red);
 	silent_img.cmap.red = NULL;
@@ -191,12 +667,35 @@ static void fbsplash_cleanup()
 	free(config_file);
 	config_file = NULL;
 
-	if (frame_buffer) {
-		munmap(frame_buffer, fb_fix.line_length * fb_var.yres);
-		frame_buffer = NULL;
+#ifdef CONFIG_KMS
+	if (kms) {
+		kms_close();
+		kms = 0;
 	}
+#endif
+	if (fb_map) {
+		munmap(fb_map, fb_fix.line_length * fb_height * fb_pages);
+		fb_map = NULL;
+	}
+	frame_buffer = NULL;
+	flipping = flips = pan_pending = page = 0;
+	damage_clear(&stale);
+	free_scaler();
+	scaled = 0;
+
+	free(present_buf);
+	present_buf = NULL;
+
+	free(fade_buf);
+	fade_buf = NULL;
+
+	present_report();
+
+	close_mirrors();
+	close_screens();
 
 	if (fb_fd >= 0) {
+		reset_fb_pages(fb_fd);
 		close(fb_fd);
 		fb_fd = -1;
 	}
@@ -206,61 +705,584 @@ static void fbsplash_cleanup()
 		fbsplash_fd = -1;
 	}
 
+	free_bars();
+	free_dlists();
+	free_box_rows();
 	free_fonts();
 
 	TTF_Quit();
 }
 
-static void update_fb_img() {
-	int y;
-	int img_line_length = fb_var.xres * ((fb_var.bits_per_pixel + 7) >> 3);
-
-	if (!silent_img.data)
+/* Pushes the areas in d of the silent image (or present_img) that lie in the
+ * current band to fb (or our framebuffer device, if that isn't mapped),
+ * converting them to its pixel format on the way. */
+static void present_areas(char *fb, damage *d) {
+	int i, y, w;
+	int img_line_length = fb_var.xres * bytespp;
+	u8 *img = present_img ? present_img : (u8*)silent_img.data;
+	u8 *src, *dst;
+	rect r;
+
+	/* Nowhere to show it */
+	if (!fb && fb_fd == -1)
 		return;
 
-	if (frame_buffer) {
-		/* Try mmap'd I/O if we have it */
-		for (y = 0; y < fb_var.yres; y++) {
-			memcpy(frame_buffer + y * fb_fix.line_length,
-					silent_img.data + (y * img_line_length),
-					img_line_length);
+	for (i = 0; i < d->cnt; i++) {
+		r = d->r[i];
+		if (!band_clip(&r.y1, &r.y2))
+			continue;
+		w = r.x2 - r.x1 + 1;
+		src = img + r.y1 * img_line_length + r.x1 * bytespp;
+
+		if (fb_rotate || scaled) {
+			dst = fb ? (u8*)fb : present_buf;
+			if (scaled) {
+				present_scaled(dst, img, &r);
+			} else {
+				present_rotated(dst, src, w, r.y2 - r.y1 + 1,
+						r.x1, r.y1);
+				rotate_rect(&r);
+			}
+			if (fb)
+				continue;
+
+			/* Write out the rows of the screen it ended up in */
+			w = (r.x2 - r.x1 + 1) * fb_bytespp;
+			for (y = r.y1; y <= r.y2; y++)
+				pwrite(fb_fd, present_buf + y * fb_fix.line_length +
+						r.x1 * fb_bytespp, w,
+						y * fb_fix.line_length + r.x1 * fb_bytespp);
+		} else if (fb) {
+			/* Try mmap'd I/O if we have it */
+			dst = (u8*)fb + r.y1 * fb_fix.line_length + r.x1 * fb_bytespp;
+			for (y = r.y1; y <= r.y2; y++) {
+				present_row(dst, src, w, r.x1, y);
+				src += img_line_length;
+				dst += fb_fix.line_length;
+			}
+		} else if (fb_fd != -1) {
+			if (fb_convert == convert_copy && w == fb_var.xres &&
+			    img_line_length == fb_fix.line_length) {
+				/* Whole lines - one write does it */
+				pwrite(fb_fd, src, img_line_length * (r.y2 - r.y1 + 1),
+						r.y1 * fb_fix.line_length);
+				continue;
+			}
+
+			for (y = r.y1; y <= r.y2; y++) {
+				dst = src;
+				if (fb_convert != convert_copy) {
+					fb_convert(present_buf, src, w, r.x1, y);
+					dst = present_buf;
+				}
+				pwrite(fb_fd, dst, w * fb_bytespp,
+						y * fb_fix.line_length + r.x1 * fb_bytespp);
+				src += img_line_length;
+			}
 		}
-	} else if (fb_fd != -1) {
-		for (y = 0; y < fb_var.yres; y++) {
-			lseek(fb_fd, y * fb_fix.line_length, SEEK_SET);
-			write(fb_fd, silent_img.data + (y * img_line_length), img_line_length);
+	}
+}
+
+/* Pushes whatever was drawn to in the current band to the framebuffers. */
+static void present_band() {
+	int i;
+
+	if (hidden)
+		return;
+
+	/* Unless it's already there */
+	if (!direct) {
+		present_areas(frame_buffer, &fb_damage);
+		if (local_damage)
+			present_areas(frame_buffer, &local_damage->fb);
+		if (flipping)
+			present_areas(frame_buffer, &stale);
+	}
+
+	for (i = 0; i < mirrors.cnt; i++) {
+		present_areas(mirrors.fb[i].map, &fb_damage);
+		if (local_damage)
+			present_areas(mirrors.fb[i].map, &local_damage->fb);
+	}
+}
+
+/* Waits until the last frame is shown, so that the one it replaced can be
+ * presented to. */
+static void wait_flip() {
+	u32 crtc = 0;
+
+#ifdef CONFIG_KMS
+	if (kms) {
+		kms_wait();
+		return;
+	}
+#endif
+	if (pan_pending)
+		ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc);
+	pan_pending = 0;
+}
+
+/* Shows the frame just presented off-screen. If it was flipped to, what we
+ * present to next is a frame behind in what changed now. */
+static void show_frame() {
+	damage shown = fb_damage;
+	int i, flipped;
+
+	/* Nothing new to show */
+	if (!fb_damage.cnt || hidden)
+		return;
+
+#ifdef CONFIG_KMS
+	/* Some drivers still need to be told what changed */
+	if (kms && !flipping)
+		kms_present(&fb_damage);
+#endif
+	if (!flipping)
+		return;
+
+	for (i = 0; i < stale.cnt; i++)
+		damage_add(&shown, stale.r[i].x1, stale.r[i].y1,
+				stale.r[i].x2, stale.r[i].y2);
+
+#ifdef CONFIG_KMS
+	if (kms) {
+		flipped = kms_present(&shown);
+		frame_buffer = (char*)kms_buffer();
+	} else
+#endif
+	{
+		flipped = !pan_fb(fb_fd, page);
+		page ^= 1;
+		frame_buffer = fb_map + page * fb_fix.line_length * fb_height;
+
+		/* Still showing the other screen; bring it up to date */
+		if (!flipped) {
+			printk("Panning doesn't work, drawing to the visible screen.\n");
+			present_areas(frame_buffer, &fb_damage);
+			present_flush();
 		}
 	}
+
+	if (flipped) {
+		flips++;
+		pan_pending = 1;
+		stale = fb_damage;
+	} else {
+		/* From now on, only what is being shown is drawn to */
+		flipping = 0;
+		damage_clear(&stale);
+	}
 }
 
-static void fbsplash_update_silent_message() {
+/* Restores, draws and presents bands first to last. */
+static void draw_bands(int first, int last) {
+	int k;
+
+	for (k = first; k <= last; k++) {
+		set_band(k * band_rows, min((k + 1) * band_rows, (int)fb_var.yres) - 1);
+		if (restoring)
+			restore_areas((u8*)silent_img.data, base_image, &restore);
+		draw_band((u8*)silent_img.data, k);
+		present_band();
+	}
+	set_band(0, INT_MAX);
+}
+
+/* Draws chunk k of the bands on a worker thread, keeping track of what it
+ * drew to by itself. */
+static void draw_chunk(int k) {
+	damage_set *d = &chunk_damage[k];
+
+	damage_clear(&d->fb);
+	damage_clear(&d->obj);
+	damage_clear(&d->bars);
+
+	local_damage = d;
+	draw_bands(k * bands / chunks, (k + 1) * bands / chunks - 1);
+	local_damage = NULL;
+
+	present_flush();
+}
+
+/* Draws and shows the frame set up with begin_objs() or begin_anims(). */
+static void draw_frame(int reset) {
+	int k;
+
+	/* What we present to can't be drawn to while it is still being
+	 * shown, and each buffer starts out empty */
+	if (flipping) {
+		wait_flip();
+		if (flips < 2)
+			damage_all(&stale);
+	}
+
+	/* Writing to the device goes through present_buf, one row at a time */
+	if (reset && chunks && !present_buf) {
+		run_jobs(draw_chunk, chunks);
+		for (k = 0; k < chunks; k++)
+			merge_damage(&chunk_damage[k]);
+	} else {
+		draw_bands(0, bands - 1);
+	}
+	present_flush();
+	show_frame();
+
+	end_objs('s');
+	damage_clear(&fb_damage);
+}
+
+/* Brings the silent image up to date and shows it. With reset, everything
+ * is drawn again over the background, otherwise only what depends on the
+ * progress (see the 'noover' box attribute). This goes a band at a time:
+ * the background of a band is restored, the objects are drawn over it and
+ * it is presented while it is still in the cache. Full redraws are spread
+ * over the worker threads; what they drew to is then merged in the order
+ * of the bands, so the outcome doesn't depend on which thread was first. */
+static void draw_screen(int reset) {
 	if (!silent_img.data || !base_image)
 		return;
 
-	reset_silent_img();
-	update_fb_img();
+	/* we need to blank out the progress bar, unless it's drawn from strips */
+	if (shrunk && !bars_can_shrink())
+		reset = 1;
+
+	restoring = reset;
+	restore = obj_damage;
+	if (reset) {
+		damage_clear(&obj_damage);
+		strncpy(rendermessage, lastheader, 512);
+	}
+	begin_objs('s', FB_SPLASH_IO_ORIG_USER, !reset);
+	rendermessage[0] = '\0';
+
+	draw_frame(reset);
+}
+
+/* Does draw_screen() for our screen and then the others. */
+static void draw_silent(int reset) {
+	int k;
+
+	draw_screen(reset);
+	for (k = 0; k < nscreens; k++) {
+		swap_screen(&screens[k]);
+		draw_screen(reset);
+		swap_screen(&screens[k]);
+	}
+}
+
+/* Draws the next frames of the animations that are due, over what is there.
+ * Returns the ms until another one is, or -1. */
+static int draw_screen_anims() {
+	int wait;
+
+	if (!silent_img.data || !base_image)
+		return -1;
+
+	restoring = 0;
+	if (begin_anims(&wait))
+		draw_frame(0);
+	else
+		end_objs('s');
+
+	return wait;
+}
+
+/* Does draw_screen_anims() for every screen. */
+static int draw_anims() {
+	int wait = draw_screen_anims(), w, k;
+
+	for (k = 0; k < nscreens; k++) {
+		swap_screen(&screens[k]);
+		w = draw_screen_anims();
+		swap_screen(&screens[k]);
+		if (w >= 0 && (wait < 0 || w < wait))
+			wait = w;
+	}
+
+	return wait;
+}
+
+/* Copies what the screen shows into a new image, if it is laid out just
+ * like ours. */
+static u8 *read_screen() {
+	int img_line_length = fb_var.xres * bytespp;
+	char *fb = frame_buffer;
+	u8 *img;
+	int y;
+
+#ifdef CONFIG_KMS
+	if (kms)
+		return NULL;
+#endif
+	if (!fb || direct || fb_rotate || scaled || fb_convert != convert_copy)
+		return NULL;
+	if (flipping)
+		fb = fb_map + (page ^ 1) * fb_fix.line_length * fb_height;
+
+	img = malloc(base_image_size);
+	if (!img)
+		return NULL;
+	for (y = 0; y < fb_var.yres; y++)
+		memcpy(img + y * img_line_length, fb + y * fb_fix.line_length,
+		       img_line_length);
+
+	return img;
+}
+
+/* Blends and presents bands first to last of a frame of a fade. */
+static void fade_bands(int first, int last) {
+	int k;
+
+	for (k = first; k <= last; k++) {
+		set_band(k * band_rows, min((k + 1) * band_rows, (int)fb_var.yres) - 1);
+		fade_areas(fade_buf, fade_from, fade_to, &fade_damage, fade_a);
+		present_band();
+	}
+	set_band(0, INT_MAX);
+}
+
+static void fade_chunk(int k) {
+	fade_bands(k * bands / chunks, (k + 1) * bands / chunks - 1);
+	present_flush();
+}
+
+/* Fades the screens from the image 'from' to 'to', either of which may be
+ * NULL for black. This takes arg_fade ms, whatever the size of the screen,
+ * in as many frames as there is time for, up to one for each step of the
+ * blend. Only where the two differ is blended and presented; elsewhere the
+ * screens have to show them already. */
+static void fade(u8 *from, u8 *to) {
+	struct timespec t0, t;
+	long ms;
+	int a, frames = 0;
+
+	if (!fade_buf || !arg_fade)
+		return;
+
+	/* What the other screens show isn't known */
+	damage_clear(&fade_damage);
+	if (from && to && !mirrors.cnt) {
+		damage_diff(&fade_damage, from, to);
+		/* A back buffer gets what it missed from here */
+		memcpy(fade_buf, to, base_image_size);
+	} else {
+		damage_all(&fade_damage);
+	}
+
+	fade_from = from;
+	fade_to = to;
+	present_img = fade_buf;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (fade_damage.cnt) {
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		ms = (t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000;
+		a = min(ms * 255 / arg_fade, 255L);
+
+		/* No more than a frame for each step */
+		if (frames && a == fade_a) {
+			usleep(1000);
+			continue;
+		}
+		fade_a = a;
+
+		if (flipping) {
+			wait_flip();
+			if (flips < 2)
+				damage_all(&stale);
+		}
+
+		fb_damage = fade_damage;
+		if (chunks && frame_buffer)
+			run_jobs(fade_chunk, chunks);
+		else
+			fade_bands(0, bands - 1);
+		present_flush();
+		show_frame();
+		damage_clear(&fb_damage);
+		frames++;
+
+		if (fade_a == 255)
+			break;
+	}
+
+	present_img = NULL;
+	if (test_run)
+		printk("fbsplash: showed a fade in %d frames.\n", frames);
+}
+
+static void fbsplash_update_silent_message() {
+	draw_silent(1);
 }
 
 static void fbsplash_message(u32 type, u32 level, u32 normally_logged, char *msg) {
+	pthread_mutex_lock(&draw_lock);
 	strncpy(lastheader, msg, 512);
 	if (console_loglevel >= SUSPEND_ERROR) {
 		if (!(suspend_action & (1 << SUSPEND_LOGALL)) || level == SUSPEND_UI_MSG)
 			printf("\n** %s\n", msg);
 	} else
 		fbsplash_update_silent_message();
+	pthread_mutex_unlock(&draw_lock);
 }
 
-static void fbsplash_redraw() {
+/* After the atomic restore, the restored kernel's driver may have changed
+ * the mode, or taken over the framebuffer. Nothing can be loaded from disk
+ * by then, so the image we have is scaled to whatever the screen is now. */
+static void follow_mode() {
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	int fd, w = fb_var.xres, h = fb_var.yres, sw, sh;
+	void *img;
+
+#ifdef CONFIG_KMS
+	/* The CRTC is still ours */
+	if (kms)
+		return;
+#endif
+	if (!silent_img.data || !base_image || (fd = open_fb()) == -1)
+		return;
+
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &var) == -1 ||
+	    ioctl(fd, FBIOGET_FSCREENINFO, &fix) == -1 ||
+	    (same_mode(&var, &fix) && fix.smem_start == fb_fix.smem_start &&
+	     fix.smem_len == fb_fix.smem_len)) {
+		close(fd);
+		return;
+	}
+
+	printk("The mode changed to %dx%d-%d, scaling the image to it.\n",
+	       var.xres, var.yres, var.bits_per_pixel);
+
+	/* The image can't stay in the old framebuffer */
+	if (direct) {
+		img = malloc(w * h * bytespp);
+		if (!img) {
+			close(fd);
+			return;
+		}
+		silent_img.data = img;
+		direct = 0;
+		damage_all(&obj_damage);
+	}
+
+	/* Let go of the old one */
+	close_mirrors();
+	if (fb_map)
+		munmap(fb_map, fb_fix.line_length * fb_height * fb_pages);
+	fb_map = NULL;
+	frame_buffer = NULL;
+	free(present_buf);
+	present_buf = NULL;
+	close(fb_fd);
+	fb_fd = fd;
+
+	flipping = flips = pan_pending = page = 0;
+	fb_pages = 1;
+	damage_clear(&stale);
+	free_scaler();
+	scaled = 0;
+
+	/* Colours only map to indices through the palette of an 8bpp image */
+	if (var.bits_per_pixel == 8 && !silent_img.cmap.red) {
+		printk("Can't show the image in the new mode.\n");
+		goto fail;
+	}
+
+	/* fb_var keeps describing the image */
+	fb_var = var;
+	fb_fix = fix;
+	init_fb_format();
+	sw = fb_var.xres;
+	sh = fb_var.yres;
+	fb_var.xres = w;
+	fb_var.yres = h;
+
+	if (sw != w || sh != h) {
+		if (init_scaler(sw, sh)) {
+			printk("Couldn't get enough memory for scaling the image.\n");
+			goto fail;
+		}
+		scaled = 1;
+	}
+
+	if ((fb_map = mmap(NULL, fb_fix.line_length * fb_height,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0)) == MAP_FAILED) {
+		fb_map = NULL;
+		if (alloc_present_buf()) {
+			printk("Couldn't get enough memory for framebuffer image.\n");
+			goto fail;
+		}
+	}
+	frame_buffer = fb_map;
+
+	if (fb_fix.visual == FB_VISUAL_DIRECTCOLOR)
+		set_directcolor_cmap(fb_fd);
+	else if (silent_img.cmap.red)
+		ioctl(fb_fd, FBIOPUTCMAP, &silent_img.cmap);
+	return;
+
+fail:
+	close(fb_fd);
+	fb_fd = -1;
+}
+
+static void redraw_silent() {
+	u8 *from;
+	int k;
+
+	/* The animations may be due again */
+	pthread_cond_signal(&anim_wake);
+
 	if (console_loglevel >= SUSPEND_ERROR) {
 		printf("\n** %s\n", lastheader);
 		return;
 	}
 
-	reset_silent_img();
-	update_fb_img();
+	if (resuming) {
+		follow_mode();
+		check_mirrors();
+	}
+
+	/* Whatever is on the screens now isn't ours, and in 8bpp modes neither
+	 * is the palette. When drawing directly, the whole background has to
+	 * be put back, not just what we drew over. */
+	if (silent_img.cmap.red && fb_fd != -1)
+		ioctl(fb_fd, FBIOPUTCMAP, &silent_img.cmap);
+	damage_all(&fb_damage);
+	if (direct)
+		damage_all(&obj_damage);
+
+	/* Fade to it from what was there */
+	if (!fade_buf || !arg_fade) {
+		draw_screen(1);
+	} else {
+		from = read_screen();
+		hidden = 1;
+		draw_screen(1);
+		hidden = 0;
+		fade(from, (u8*)silent_img.data);
+		free(from);
+	}
+
+	/* The other screens are just shown */
+	for (k = 0; k < nscreens; k++) {
+		swap_screen(&screens[k]);
+		if (resuming)
+			check_mirrors();
+		damage_all(&fb_damage);
+		draw_screen(1);
+		swap_screen(&screens[k]);
+	}
 }
 
-static void fbsplash_update_progress(u32 value, u32 maximum, char *msg) {
+static void fbsplash_redraw() {
+	pthread_mutex_lock(&draw_lock);
+	redraw_silent();
+	pthread_mutex_unlock(&draw_lock);
+}
+
+static void update_progress(u32 value, u32 maximum, char *msg) {
 	int bitshift, tmp;
 
 	if (console_loglevel >= SUSPEND_ERROR)
@@ -291,11 +1313,7 @@ static void fbsplash_update_progress(u32 value, u32 maximum, char *msg) {
 	cur_value = value;
 	cur_maximum = maximum;
 
-	if (tmp < last_pos) { /* we need to blank out the progress bar */
-		arg_progress = 0;
-		reset_silent_img();
-	}
-
+	shrunk = tmp < last_pos;
 	last_pos = tmp;
 	arg_progress = tmp;
 
@@ -303,19 +1321,29 @@ static void fbsplash_update_progress(u32 value, u32 maximum, char *msg) {
 		progress_text = msg;
 
 render:
-	render_objs((u8*)silent_img.data, NULL, 's', FB_SPLASH_IO_ORIG_USER, 0);
-	update_fb_img();
+	draw_silent(0);
 
+	shrunk = 0;
 	progress_text = NULL;
 }
 
+static void fbsplash_update_progress(u32 value, u32 maximum, char *msg) {
+	pthread_mutex_lock(&draw_lock);
+	update_progress(value, maximum, msg);
+	pthread_mutex_unlock(&draw_lock);
+}
+
 static void fbsplash_log_level_change() {
 	/* Only reset the display if we're switching between nice display
 	 * and displaying debugging output */
 
+	pthread_mutex_lock(&draw_lock);
+
 	if (console_loglevel >= SUSPEND_ERROR) {
-		if (lastloglevel < SUSPEND_ERROR)
+		if (lastloglevel < SUSPEND_ERROR) {
+			fade((u8*)silent_img.data, NULL);
 			silent_off();
+		}
 
 		printf("\nSwitched to console loglevel %d.\n", console_loglevel);
 
@@ -326,10 +1354,11 @@ static void fbsplash_log_level_change() {
 		hide_cursor();
 
 		/* Get the nice display or last action [re]drawn */
-		fbsplash_redraw();
+		redraw_silent();
 	}
 	
 	lastloglevel = console_loglevel;
+	pthread_mutex_unlock(&draw_lock);
 }
 
 static void fbsplash_keypress(int key) {
@@ -357,6 +1386,31 @@ static int fbsplash_option_handler(char c)
 		case 'T':
 			arg_theme = strdup(optarg);
 			return 1;
+		case 'D':
+			arg_direct = 1;
+			return 1;
+		case 'j':
+			arg_threads = atoi(optarg);
+			return 1;
+#ifdef CONFIG_KMS
+		case 'K':
+			arg_kms = 1;
+			return 1;
+#endif
+		case 'R':
+			arg_rotate = atoi(optarg);
+			return 1;
+		case 'F':
+			arg_fade = max(atoi(optarg), 0);
+			return 1;
+		case 'G':
+			arg_glyph_cache = min(max(atoi(optarg), 0), INT_MAX >> 10);
+			return 1;
+#ifdef CONFIG_MNG
+		case 'A':
+			arg_anim_cache = max(atoi(optarg), 0);
+			return 1;
+#endif
 		default:
 			return 0;
 	}
@@ -368,16 +1422,122 @@ static char *fbsplash_cmdline_options()
 "\n"
 "  FBSPLASH:\n"
 "  -T <theme name>, --theme <theme name>\n"
-"     Selects a given theme from " THEME_DIR " (default: "DEFAULT_THEME") for fbsplash support.\n";
+"     Selects a given theme from " THEME_DIR " (default: "DEFAULT_THEME") for fbsplash support.\n"
+"  -D, --direct\n"
+"     Draws straight into the framebuffer, for framebuffers in ordinary memory\n"
+"     (the default for drivers known to keep theirs there).\n"
+"  -j <n>, --threads <n>\n"
+"     Uses up to n CPUs for redrawing the whole screen (default: 4).\n"
+"  -R <n>, --rotate <n>\n"
+"     Turns the image n quarters clockwise (default: as the console is turned).\n"
+"  -F <ms>, --fade <ms>\n"
+"     Fades between the silent image and the console in ms milliseconds (default:\n"
+"     300, 0 turns fades off).\n"
+"  -G <kB>, --glyph-cache <kB>\n"
+"     Keeps up to kB kilobytes of glyphs of characters past Latin-1 (default: 256).\n"
+#ifdef CONFIG_MNG
+"  -A <kB>, --anim-cache <kB>\n"
+"     Decodes the frames of the animations when the theme is loaded, keeping up\n"
+"     to kB kilobytes of them (default: 0, decoding them as they are shown).\n"
+#endif
+#ifdef CONFIG_KMS
+"  -K, --kms\n"
+"     Shows the silent image through " PATH_DEV "/dri/card0 (the default when there is\n"
+"     no framebuffer device).\n"
+#endif
+;
 }
 
 static struct option userui_fbsplash_longopts[] = {
 	{"theme", 1, 0, 'T'},
+	{"direct", 0, 0, 'D'},
+	{"threads", 1, 0, 'j'},
+	{"rotate", 1, 0, 'R'},
+	{"fade", 1, 0, 'F'},
+	{"glyph-cache", 1, 0, 'G'},
+#ifdef CONFIG_MNG
+	{"anim-cache", 1, 0, 'A'},
+#endif
+#ifdef CONFIG_KMS
+	{"kms", 0, 0, 'K'},
+#endif
 	{NULL, 0, 0, 0},
 };
 
+/* Shows the next frames of the animations as they are due, however often
+ * or rarely messages come in. Sleeps while there are none to show. */
+static void *animate(void *unused) {
+	struct timespec t;
+	int wait;
+
+	pthread_mutex_lock(&draw_lock);
+	while (animating) {
+		wait = -1;
+		if (console_loglevel < SUSPEND_ERROR && lastloglevel < SUSPEND_ERROR)
+			wait = draw_anims();
+
+		if (wait < 0) {
+			pthread_cond_wait(&anim_wake, &draw_lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		t.tv_sec += wait / 1000;
+		t.tv_nsec += (wait % 1000) * 1000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&anim_wake, &draw_lock, &t);
+	}
+	pthread_mutex_unlock(&draw_lock);
+
+	return NULL;
+}
+
+static void start_animating() {
+	pthread_condattr_t cattr;
+	pthread_attr_t attr;
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&anim_wake, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, ANIM_STACK);
+	animating = 1;
+	if (pthread_create(&anim_thread, &attr, animate, NULL)) {
+		animating = 0;
+		pthread_cond_destroy(&anim_wake);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Starts the threads for full redraws, one for each CPU we may use but the
+ * one we're running on, and the one for the animations. */
+static void start_threads() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n;
+
+	stop_threads();
+
+	n = start_workers(min(arg_threads, (int)cpus) - 1);
+	if (n) {
+		/* Several chunks per thread evens out the work */
+		chunks = min(4 * (n + 1), bands);
+		chunk_damage = malloc(chunks * sizeof(damage_set));
+		if (!chunk_damage)
+			stop_threads();
+	}
+
+	start_animating();
+}
+
 static void fbsplash_prepare()
 {
+	start_threads();
+
 	move_cursor_to(0,0);
 	clear_display();
 	hide_cursor();
@@ -387,6 +1547,7 @@ static void fbsplash_prepare()
 
 struct userui_ops userui_fbsplash_ops = {
 	.name = "fbsplash",
+	.preload = fbsplash_preload,
 	.load = fbsplash_load,
 	.prepare = fbsplash_prepare,
 	.unprepare = fbsplash_unprepare,
@@ -399,7 +1560,14 @@ struct userui_ops userui_fbsplash_ops = {
 	.memory_required = fbsplash_memory_required,
 
 	/* cmdline options */
-	.optstring = "T:",
+	.optstring = "T:Dj:R:F:G:"
+#ifdef CONFIG_KMS
+		"K"
+#endif
+#ifdef CONFIG_MNG
+		"A:"
+#endif
+		,
 	.longopts  = userui_fbsplash_longopts,
 	.option_handler = fbsplash_option_handler,
 	.cmdline_options = fbsplash_cmdline_options,
@@ -0,0 +1,121 @@
+/*
+ * workers.c - A small pool of threads for drawing large frames
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+/* The calling thread hands out numbered jobs and works on them alongside the
+ * workers, and run_jobs() only returns once all of them are done. Which
+ * thread gets which job is up to chance, so the jobs must not depend on
+ * each other. */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "splash.h"
+
+/* Nothing deep is run on the workers; keep what gets mlocked small. */
+#define WORKER_STACK	(256 << 10)
+
+static pthread_t *workers;
+static int nworkers;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static void (*job_fn)(int k);
+static int next_job, njobs, jobs_left, quit;
+
+/* Takes the next job. Called with lock held, which is dropped while the
+ * job runs. */
+static void do_job()
+{
+	int k = next_job++;
+
+	pthread_mutex_unlock(&lock);
+	job_fn(k);
+	pthread_mutex_lock(&lock);
+
+	if (--jobs_left == 0)
+		pthread_cond_signal(&done);
+}
+
+static void *worker(void *unused)
+{
+	pthread_mutex_lock(&lock);
+	while (!quit) {
+		if (next_job < njobs)
+			do_job();
+		else
+			pthread_cond_wait(&go, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/* Starts up to n worker threads, returns how many are running. */
+int start_workers(int n)
+{
+	pthread_attr_t attr;
+
+	stop_workers();
+
+	if (n <= 0 || !(workers = malloc(n * sizeof(pthread_t))))
+		return 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+	quit = 0;
+	for (nworkers = 0; nworkers < n; nworkers++)
+		if (pthread_create(&workers[nworkers], &attr, worker, NULL))
+			break;
+
+	pthread_attr_destroy(&attr);
+	return nworkers;
+}
+
+void stop_workers()
+{
+	int k;
+
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_broadcast(&go);
+	pthread_mutex_unlock(&lock);
+
+	for (k = 0; k < nworkers; k++)
+		pthread_join(workers[k], NULL);
+
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+/* Runs fn(0) to fn(n - 1), spread over the workers and the caller. */
+void run_jobs(void (*fn)(int k), int n)
+{
+	int k;
+
+	if (!nworkers) {
+		for (k = 0; k < n; k++)
+			fn(k);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	job_fn = fn;
+	next_job = 0;
+	njobs = jobs_left = n;
+	pthread_cond_broadcast(&go);
+
+	while (next_job < njobs)
+		do_job();
+	while (jobs_left)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+}
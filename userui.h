@@ -9,6 +9,7 @@
 
 struct userui_ops {
 	char *name;
+	void (*preload) ();	/* before our memory is locked */
 	int (*load) ();
 	void (*prepare) ();
 	void (*unprepare) ();
@@ -57,6 +58,7 @@ extern volatile __uint32_t console_loglevel;
 extern volatile __uint32_t suspend_action;
 extern volatile __uint32_t suspend_debug;
 extern volatile int resuming;
+extern int test_run;
 
 /* excerpts from include/linux/suspend2.h : */
 
@@ -47,7 +47,7 @@ static struct termios termios_backup;
 static int have_termios_backup = 0;
 static int raw_keypresses = 0;
 static int nlsock = -1;
-static int test_run = 0;
+int test_run = 0;
 static int running = 0;
 static int need_cleanup = 0;
 static int safe_to_exit = 1;
@@ -1040,6 +1040,10 @@ int main(int argc, char **argv) {
 		get_info();
 	}
 
+	for (i = 0; i < NUM_UIS; i++)
+		if (userui_ops[i] && userui_ops[i]->preload)
+			userui_ops[i]->preload();
+
 	lock_memory();
 
 	prepare_console();